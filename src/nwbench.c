@@ -0,0 +1,214 @@
+/*
+ * nwbench: nwtool parser and emitter microbenchmarks
+ *
+ * Copyright (C) 2008-2009 Peter Korsgaard <peter.korsgaard@barco.com>
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+/* the benchmarks exercise static functions, so include the sources */
+#include "nwtool-serial.c"
+#ifdef WITH_USB
+#include "nwtool-usb.c"
+#endif /* WITH_USB */
+
+/* minimum run time of each benchmark in ns */
+#define NW_BENCH_MINTIME	500000000ULL
+#define NW_BENCH_FRAMES		4096
+
+/* print result as a JSON object on a line of its own */
+static void nw_bench_result(const char *name, unsigned long long ops,
+			    uint64_t ns, const char *unit)
+{
+	printf("{ \"bench\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, "
+	       "\"rate\": %.0f, \"unit\": \"%s\", \"ns_per_op\": %.2f }\n",
+	       name, ops, ns / 1e9, ops * 1e9 / ns, unit, (double)ns / ops);
+}
+
+/* stream of touch frames of varying position and button state */
+static unsigned char *nw_bench_stream(int frames)
+{
+	unsigned char *data, *p;
+	uint32_t xi, yi;
+	float x, y;
+	int i;
+
+	data = malloc(frames * NW_SER_FRAMELEN);
+	if (!data) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i=0, p=data; i<frames; i++, p += NW_SER_FRAMELEN) {
+		x = i * 7 % 32768;
+		y = i * 13 % 32768;
+		memcpy(&xi, &x, sizeof(xi));
+		memcpy(&yi, &y, sizeof(yi));
+		xi = htonl(xi);
+		yi = htonl(yi);
+		memcpy(p+0, &xi, sizeof(xi));
+		memcpy(p+4, &yi, sizeof(yi));
+		p[8] = (i % 16) ? 0x01 : 0x00;
+		memcpy(p+9, NW_SER_FOOTER, NW_SER_FOOTERLEN);
+	}
+
+	return data;
+}
+
+/* frames/s through the framer and decoder, read() sized chunks */
+static void nw_bench_serial_parse(const unsigned char *data, int frames,
+				  int chunk)
+{
+	struct nwserial *nw;
+	unsigned long long ops = 0;
+	uint64_t start, ns;
+	unsigned int len, pos;
+	char name[32];
+
+	nw = nw_serial_alloc("bench");
+	if (!nw)
+		exit(1);
+
+	len = frames * NW_SER_FRAMELEN;
+	start = nw_serial_now();
+	do {
+		for (pos = 0; pos < len; pos += chunk) {
+			nw->lat.read = nw_serial_now();
+			nw_serial_feed(nw, data + pos,
+				       len - pos < chunk ? len - pos : chunk);
+		}
+		ops += frames;
+		ns = nw_serial_now() - start;
+	} while (ns < NW_BENCH_MINTIME);
+
+	snprintf(name, sizeof(name), "serial_parse_%d", chunk);
+	nw_bench_result(name, ops, ns, "frames/s");
+	nw_serial_free(nw);
+}
+
+/* cost of queuing and writing reports, to /dev/null instead of uinput */
+static void nw_bench_uinput_emit(int batch)
+{
+	struct nwserial *nw;
+	unsigned long long ops = 0;
+	uint64_t start, ns;
+	char name[32];
+	int i;
+
+	nw = nw_serial_alloc("bench");
+	if (!nw)
+		exit(1);
+
+	nw->ufd = open("/dev/null", O_WRONLY);
+	if (nw->ufd == -1) {
+		perror("/dev/null");
+		exit(1);
+	}
+
+	start = nw_serial_now();
+	do {
+		for (i=0; i<NW_BENCH_FRAMES; i++) {
+			nw_uinput_action(nw, i, i, i & 1);
+			if ((i + 1) % batch == 0)
+				nw_uinput_flush(nw);
+		}
+		nw_uinput_flush(nw);
+		ops += NW_BENCH_FRAMES;
+		ns = nw_serial_now() - start;
+	} while (ns < NW_BENCH_MINTIME);
+
+	snprintf(name, sizeof(name), "uinput_emit_%d", batch);
+	nw_bench_result(name, ops, ns, "reports/s");
+	close(nw->ufd);
+	nw_serial_free(nw);
+}
+
+#ifdef WITH_USB
+/* nw_usb_parse() decode rate over all known 'C' responses */
+static void nw_bench_usb_parse(void)
+{
+	static const unsigned char codes[] = {
+		0x10, 0x11, 0x12, 0x20, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35,
+		0x40, 0x41
+	};
+	unsigned char buf[sizeof(codes)][NWUSB_PACKETSIZE];
+	unsigned long long ops = 0;
+	unsigned int result, sum = 0;
+	uint64_t start, ns;
+	int i;
+
+	memset(buf, 0, sizeof(buf));
+	for (i=0; i<sizeof(codes); i++) {
+		buf[i][0] = 'C';
+		buf[i][1] = 5;
+		buf[i][2] = codes[i];
+		buf[i][3] = i;
+		buf[i][4] = i * 3;
+	}
+
+	start = nw_serial_now();
+	do {
+		for (i=0; i<NW_BENCH_FRAMES; i++)
+			sum += nw_usb_parse(0, buf[i % sizeof(codes)],
+					    &result) + result;
+		ops += NW_BENCH_FRAMES;
+		ns = nw_serial_now() - start;
+	} while (ns < NW_BENCH_MINTIME);
+
+	nw_bench_result("usb_parse", ops, ns, "packets/s");
+
+	/* keep the compiler from optimizing the loop away */
+	if (sum == 0xdeadbeef)
+		fprintf(stderr, "\n");
+}
+
+/* full show_info query sweeps against the mock device, without latency */
+static void nw_bench_usb_query(void)
+{
+	unsigned int val[NWUSB_GOT_MAX + 1];
+	unsigned long long ops = 0;
+	uint64_t start, ns;
+	struct nwusb *nw;
+	int i;
+
+	nw = nw_usb_init_mock(0, 0, 0);
+	if (!nw)
+		exit(1);
+
+	start = nw_serial_now();
+	do {
+		for (i=0; i<NW_BENCH_FRAMES / NWUSB_GOT_MAX; i++)
+			if (nw_usb_query(nw, NWUSB_GOT_ALL, val)
+			    != NWUSB_GOT_ALL)
+				exit(1);
+		ops += NW_BENCH_FRAMES / NWUSB_GOT_MAX;
+		ns = nw_serial_now() - start;
+	} while (ns < NW_BENCH_MINTIME);
+
+	nw_bench_result("usb_query", ops, ns, "sweeps/s");
+	nw_usb_deinit(nw);
+}
+#endif /* WITH_USB */
+
+int main(int argc, char **argv)
+{
+	unsigned char *data;
+
+	data = nw_bench_stream(NW_BENCH_FRAMES);
+
+	nw_bench_serial_parse(data, NW_BENCH_FRAMES, NW_SER_FRAMELEN);
+	nw_bench_serial_parse(data, NW_BENCH_FRAMES, 256);
+	nw_bench_serial_parse(data, NW_BENCH_FRAMES, NW_SER_BUFSIZE);
+	nw_bench_uinput_emit(1);
+	nw_bench_uinput_emit(NW_SER_MAXREPORTS);
+#ifdef WITH_USB
+	nw_bench_usb_parse();
+	nw_bench_usb_query();
+#endif /* WITH_USB */
+
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,429 @@
+/*
+ * nwsim: NextWindow serial touchscreen simulator
+ *
+ * Copyright (C) 2008-2009 Peter Korsgaard <peter.korsgaard@barco.com>
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE /* ptsname */
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define NW_SIM_RANGE		32767
+/* max nr of frames generated per wakeup */
+#define NW_SIM_BURST		64
+#define NW_SIM_FRAMELEN		15
+/* frames per second, so the frame period is at least 1 us */
+#define NW_SIM_MAXRATE		1000000
+
+enum nwsim_pattern {
+	NW_SIM_CIRCLE,	/* drag around a circle, releasing every turn */
+	NW_SIM_TAP,	/* taps at random positions */
+	NW_SIM_STILL,	/* finger resting in the middle */
+	NW_SIM_RANDOM,	/* random positions and buttons */
+};
+
+struct nwsim {
+	int fd; /* pty master */
+	int slave; /* kept open so the master doesn't get EIO on close */
+	enum nwsim_pattern pattern;
+	double rate; /* frames per second */
+	int noise; /* max coordinate noise */
+	int garbage; /* chance of line noise per frame, in 1/1000 */
+	unsigned long count; /* frames to send, 0 = unlimited */
+	uint32_t serial;
+	uint32_t version;
+	unsigned long seq;
+	char cmd[16]; /* received command */
+	int cmd_pos;
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long junk;
+	unsigned long cmds;
+};
+
+static volatile sig_atomic_t nw_sim_quit;
+
+static void nw_sim_sighandler(int sig)
+{
+	nw_sim_quit = 1;
+}
+
+static uint64_t nw_sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void nw_sim_frame(unsigned char *buf, uint32_t xi, uint32_t yi,
+			 unsigned char type)
+{
+	xi = htonl(xi);
+	yi = htonl(yi);
+
+	memcpy(buf+0, &xi, sizeof(xi));
+	memcpy(buf+4, &yi, sizeof(yi));
+	buf[8] = type;
+	memcpy(buf+9, "<END>\r", 6);
+}
+
+static void nw_sim_touch(unsigned char *buf, float x, float y,
+			 unsigned char type)
+{
+	uint32_t xi, yi;
+
+	if (x < 0)
+		x = 0;
+	if (x > NW_SIM_RANGE)
+		x = NW_SIM_RANGE;
+	if (y < 0)
+		y = 0;
+	if (y > NW_SIM_RANGE)
+		y = NW_SIM_RANGE;
+
+	memcpy(&xi, &x, sizeof(xi));
+	memcpy(&yi, &y, sizeof(yi));
+
+	nw_sim_frame(buf, xi, yi, type);
+}
+
+static int nw_sim_noise(struct nwsim *sim)
+{
+	if (!sim->noise)
+		return 0;
+
+	return rand() % (2 * sim->noise + 1) - sim->noise;
+}
+
+/* generate the next touch frame of the pattern */
+static void nw_sim_next(struct nwsim *sim, unsigned char *buf)
+{
+	static float tap_x, tap_y;
+	unsigned long n = sim->seq++;
+	float x, y;
+	unsigned char type = 0x01; /* left button, inside LCD */
+
+	switch (sim->pattern) {
+	case NW_SIM_CIRCLE:
+		x = NW_SIM_RANGE/2 + NW_SIM_RANGE/3 * cos(n % 360 * M_PI / 180);
+		y = NW_SIM_RANGE/2 + NW_SIM_RANGE/3 * sin(n % 360 * M_PI / 180);
+		if (n % 360 == 359)
+			type = 0x00;
+		break;
+
+	case NW_SIM_TAP:
+		/* 5 frames down, 1 up */
+		if (n % 6 == 0) {
+			tap_x = rand() % NW_SIM_RANGE;
+			tap_y = rand() % NW_SIM_RANGE;
+		}
+		x = tap_x;
+		y = tap_y;
+		if (n % 6 == 5)
+			type = 0x00;
+		break;
+
+	case NW_SIM_STILL:
+		x = y = NW_SIM_RANGE/2;
+		break;
+
+	case NW_SIM_RANDOM:
+	default:
+		x = rand() % NW_SIM_RANGE;
+		y = rand() % NW_SIM_RANGE;
+		type = rand() % 3;
+		break;
+	}
+
+	nw_sim_touch(buf, x + nw_sim_noise(sim), y + nw_sim_noise(sim), type);
+}
+
+static void nw_sim_write(struct nwsim *sim, const void *buf, int len)
+{
+	int n;
+
+	n = write(sim->fd, buf, len);
+	if (n == -1 && errno != EAGAIN) {
+		perror("write");
+		nw_sim_quit = 1;
+	}
+
+	/* like a real UART, data is lost if the receiver doesn't keep up */
+	if (n != len)
+		sim->dropped += (len - (n > 0 ? n : 0)) / NW_SIM_FRAMELEN;
+}
+
+static void nw_sim_command(struct nwsim *sim)
+{
+	unsigned char buf[NW_SIM_FRAMELEN];
+
+	sim->cmds++;
+
+	if (!strcmp(sim->cmd, "nwgs")) {
+		nw_sim_frame(buf, sim->serial, sim->version, 0x73);
+		nw_sim_write(sim, buf, sizeof(buf));
+	} else if (!strcmp(sim->cmd, "nwk0") || !strcmp(sim->cmd, "nwk1")) {
+		nw_sim_frame(buf, 0, sim->cmd[3] == '1', 0x6b);
+		nw_sim_write(sim, buf, sizeof(buf));
+	} else {
+		fprintf(stderr, "Unknown command '%s'\n", sim->cmd);
+	}
+}
+
+static void nw_sim_receive(struct nwsim *sim)
+{
+	char buf[64];
+	int i, n;
+
+	n = read(sim->fd, buf, sizeof(buf));
+	for (i=0; i<n; i++) {
+		if (buf[i] == '\r') {
+			sim->cmd[sim->cmd_pos] = 0;
+			nw_sim_command(sim);
+			sim->cmd_pos = 0;
+		} else if (sim->cmd_pos < sizeof(sim->cmd) - 1) {
+			sim->cmd[sim->cmd_pos++] = buf[i];
+		}
+	}
+}
+
+static int nw_sim_open(struct nwsim *sim, const char *link)
+{
+	struct termios tio;
+	char *name;
+
+	sim->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (sim->fd == -1) {
+		perror("posix_openpt");
+		return 1;
+	}
+
+	if (grantpt(sim->fd) || unlockpt(sim->fd)) {
+		perror("grantpt");
+		close(sim->fd);
+		return 1;
+	}
+
+	name = ptsname(sim->fd);
+	sim->slave = open(name, O_RDWR | O_NOCTTY);
+	if (sim->slave == -1) {
+		perror(name);
+		close(sim->fd);
+		return 1;
+	}
+
+	/* frames are binary, so no line discipline processing */
+	tcgetattr(sim->slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(sim->slave, TCSANOW, &tio);
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			perror(link);
+			close(sim->slave);
+			close(sim->fd);
+			return 1;
+		}
+		name = (char *)link;
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	return 0;
+}
+
+static void nw_sim_run(struct nwsim *sim)
+{
+	unsigned char buf[NW_SIM_BURST * (NW_SIM_FRAMELEN + 4)];
+	uint64_t start, now, period;
+	unsigned long due;
+	struct pollfd pfd;
+	int i, len, timeout;
+
+	period = 1e9 / sim->rate;
+	start = nw_sim_now();
+
+	pfd.fd = sim->fd;
+	pfd.events = POLLIN;
+
+	while (!nw_sim_quit) {
+		now = nw_sim_now();
+		due = (now - start) / period + 1;
+		if (sim->count && due > sim->count)
+			due = sim->count;
+
+		/* send all frames due, in bursts */
+		while (sim->seq < due) {
+			len = 0;
+			for (i=0; i<NW_SIM_BURST && sim->seq < due; i++) {
+				if (sim->garbage
+				    && rand() % 1000 < sim->garbage) {
+					memcpy(buf + len, "<EN\x01", 4);
+					len += 4;
+					sim->junk++;
+				}
+
+				nw_sim_next(sim, buf + len);
+				len += NW_SIM_FRAMELEN;
+			}
+
+			nw_sim_write(sim, buf, len);
+			sim->sent += i;
+		}
+
+		if (sim->count && sim->seq >= sim->count)
+			break;
+
+		/* wait for a command or the next frame */
+		now = nw_sim_now();
+		timeout = (start + due * period - now) / 1000000;
+		if (timeout < 0)
+			timeout = 0;
+
+		if (poll(&pfd, 1, timeout) > 0)
+			nw_sim_receive(sim);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: nwsim [OPTION] ...\n"
+		"  -h, --help\t\t\tshow usage info\n"
+		"  -l, --link <path>\t\tsymlink pty to <path>\n"
+		"  -r, --rate <hz>\t\tframes per second (default 100)\n"
+		"  -p, --pattern <name>\t\tcircle, tap, still or random\n"
+		"  -n, --noise <value>\t\tmax coordinate noise\n"
+		"  -g, --garbage <value>\t\tline noise chance per mille\n"
+		"  -c, --count <nr>\t\tstop after <nr> frames\n"
+		"  -S, --serial-nr <nr>\t\tserial number to report\n");
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "help",		no_argument,		0, 'h' },
+		{ "link",		required_argument,	0, 'l' },
+		{ "rate",		required_argument,	0, 'r' },
+		{ "pattern",		required_argument,	0, 'p' },
+		{ "noise",		required_argument,	0, 'n' },
+		{ "garbage",		required_argument,	0, 'g' },
+		{ "count",		required_argument,	0, 'c' },
+		{ "serial-nr",		required_argument,	0, 'S' },
+		{ 0, 0, 0, 0 }
+	};
+	static const char *patterns[] = {
+		[NW_SIM_CIRCLE]	= "circle",
+		[NW_SIM_TAP]	= "tap",
+		[NW_SIM_STILL]	= "still",
+		[NW_SIM_RANDOM]	= "random",
+	};
+	struct nwsim sim;
+	struct sigaction sa;
+	char *link = 0, *endp;
+	int c, i;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.rate = 100;
+	sim.serial = 12345;
+	sim.version = (1 << 24) | (40 << 16);
+
+	do {
+		c = getopt_long(argc, argv, "hl:r:p:n:g:c:S:", options, 0);
+
+		switch (c) {
+		case 'l':
+			link = optarg;
+			break;
+
+		case 'r':
+			sim.rate = strtod(optarg, &endp);
+			if (*endp
+			    || !(sim.rate > 0 && sim.rate <= NW_SIM_MAXRATE)) {
+				fprintf(stderr, "rate must be above 0 and at most "
+					"%d\n", NW_SIM_MAXRATE);
+				usage();
+			}
+			break;
+
+		case 'p':
+			for (i=0; i<sizeof(patterns)/sizeof(patterns[0]); i++)
+				if (!strcmp(optarg, patterns[i]))
+					break;
+
+			if (i == sizeof(patterns)/sizeof(patterns[0]))
+				usage();
+			sim.pattern = i;
+			break;
+
+		case 'n':
+			sim.noise = atoi(optarg);
+			break;
+
+		case 'g':
+			sim.garbage = atoi(optarg);
+			break;
+
+		case 'c':
+			sim.count = strtoul(optarg, 0, 0);
+			break;
+
+		case 'S':
+			sim.serial = strtoul(optarg, 0, 0);
+			break;
+
+		case -1:
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	} while (c != -1);
+
+	if (nw_sim_open(&sim, link))
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nw_sim_sighandler;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	nw_sim_run(&sim);
+
+	fprintf(stderr, "Sent %lu frames (%lu dropped, %lu junk), "
+		"%lu commands\n", sim.sent, sim.dropped, sim.junk, sim.cmds);
+
+	/* give the receiver a chance to drain before closing the pty */
+	if (!nw_sim_quit)
+		sleep(1);
+
+	if (link)
+		unlink(link);
+	close(sim.slave);
+	close(sim.fd);
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * nwtool: NextWindow touchscreen utility
+ *
+ * Copyright (C) 2008-2009 Peter Korsgaard <peter.korsgaard@barco.com>
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#include <string.h>
+#include "nwtool-hist.h"
+
+static int nw_hist_index(uint64_t val)
+{
+	int shift;
+
+	if (val < NW_HIST_SUB)
+		return val;
+
+	shift = 63 - __builtin_clzll(val) - NW_HIST_SUBBITS;
+
+	return (shift + 1) * NW_HIST_SUB + (val >> shift) - NW_HIST_SUB;
+}
+
+/* highest value counted in bucket idx */
+static uint64_t nw_hist_value(int idx)
+{
+	int shift;
+
+	if (idx < NW_HIST_SUB)
+		return idx;
+
+	shift = idx / NW_HIST_SUB - 1;
+
+	return (((uint64_t)(idx % NW_HIST_SUB + NW_HIST_SUB + 1)) << shift) - 1;
+}
+
+void nw_hist_reset(struct nwhist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void nw_hist_add(struct nwhist *h, uint64_t val)
+{
+	if (!h->count || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+
+	h->count++;
+	h->sum += val;
+	h->bucket[nw_hist_index(val)]++;
+}
+
+uint64_t nw_hist_percentile(const struct nwhist *h, double pct)
+{
+	unsigned long seen = 0, wanted;
+	uint64_t val;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	wanted = h->count * pct / 100.0;
+	if (wanted < 1)
+		wanted = 1;
+
+	for (i=0; i<NW_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= wanted)
+			break;
+	}
+
+	val = nw_hist_value(i);
+
+	return val > h->max ? h->max : val;
+}
+
+void nw_hist_show(const struct nwhist *h, const char *name, FILE *f)
+{
+	if (!h->count)
+		return;
+
+	fprintf(f, "  %-10s n=%lu min=%.1f avg=%.1f p50=%.1f p90=%.1f "
+		"p99=%.1f p99.9=%.1f max=%.1f us\n", name, h->count,
+		h->min / 1000.0, (double)h->sum / h->count / 1000.0,
+		nw_hist_percentile(h, 50.0) / 1000.0,
+		nw_hist_percentile(h, 90.0) / 1000.0,
+		nw_hist_percentile(h, 99.0) / 1000.0,
+		nw_hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
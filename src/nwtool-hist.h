@@ -0,0 +1,40 @@
+/*
+ * nwtool: NextWindow touchscreen utility
+ *
+ * Copyright (C) 2008-2009 Peter Korsgaard <peter.korsgaard@barco.com>
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#ifndef _NWTOOL_HIST_H_
+#define _NWTOOL_HIST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* log-linear (HDR style) histogram: values below 2^NW_HIST_SUBBITS are
+   counted exactly, larger values with NW_HIST_SUBBITS bits of precision */
+#define NW_HIST_SUBBITS	4
+#define NW_HIST_SUB	(1 << NW_HIST_SUBBITS)
+#define NW_HIST_BUCKETS	((64 - NW_HIST_SUBBITS + 1) * NW_HIST_SUB)
+
+struct nwhist {
+	unsigned long count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	unsigned long bucket[NW_HIST_BUCKETS];
+};
+
+void nw_hist_reset(struct nwhist *h);
+
+void nw_hist_add(struct nwhist *h, uint64_t val);
+
+uint64_t nw_hist_percentile(const struct nwhist *h, double pct);
+
+/* print a one line summary of a histogram of ns values in us */
+void nw_hist_show(const struct nwhist *h, const char *name, FILE *f);
+
+#endif /* _NWTOOL_HIST_H_ */
@@ -8,6 +8,7 @@
  * kind, whether express or implied.
  */
 
+#define _GNU_SOURCE /* sched_setaffinity */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -20,27 +21,195 @@
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <linux/serial.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include "nwtool-serial.h"
+#include "nwtool-hist.h"
 
 /* #define NW_SER_VERBOSE 1 */
 #define NW_SER_BAUDRATE	B115200
-#define NW_SER_BUFSIZE	256
+#define NW_SER_BUFSIZE	4096 /* default, power of 2 */
+#define NW_SER_BUFSIZE_MIN	64
+#define NW_SER_BUFSIZE_MAX	(1 << 20)
+/* record file format: magic, followed by chunks of a header (big endian
+   time since previous chunk in us and length) and the raw data */
+#define NW_SER_REC_MAGIC	"NWREC\0\0\1"
+#define NW_SER_REC_MAGICLEN	8
+/* initial nr of button transitions kept back when the report queue is
+   full, doubled as needed */
+#define NW_SER_STASHSIZE	256
+/* retry interval for reports that didn't fit in the queue, in ms */
+#define NW_SER_QUEUE_RETRY	1
+/* default ms to wait for the response to an info query */
+#define NW_SER_INFO_TIMEOUT	500
+/* reconnect backoff in ms */
+#define NW_SER_RECONNECT_MIN	50
+#define NW_SER_RECONNECT_MAX	5000
+/* max coordinate reported to uinput */
+#define NW_SER_MAXCOORD		32767
+/* time it takes to receive a frame at 115200 baud 8N1, in ns */
+#define NW_SER_FRAMETIME	(NW_SER_FRAMELEN * 10 * 1000000000ULL / 115200)
+/* cutoff frequency for the speed estimate of the jitter filter, Q16 Hz */
+#define NW_SER_DCUTOFF		(1 << 16)
+/* min time between line error summaries, in ns */
+#define NW_SER_LOGINTERVAL	(10 * 1000000000ULL)
+/* nr of log2 buckets in bytes per wakeup histogram */
+#define NW_SER_HISTSIZE		16
+/* max nr of epoll events handled per wakeup */
+#define NW_SER_MAXEVENTS	16
+
+/* frame is 9 bytes of payload followed by the '<END>\r' footer */
+#define NW_SER_FOOTER		"<END>\r"
+#define NW_SER_FOOTERLEN	(sizeof(NW_SER_FOOTER)-1)
+#define NW_SER_PAYLOADLEN	9
+#define NW_SER_FRAMELEN		(NW_SER_PAYLOADLEN + NW_SER_FOOTERLEN)
+/* max nr of uinput events queued before they are written out */
+#define NW_SER_EVBUFSIZE	64
+/* max events per report */
+#define NW_SER_REPORTLEN	5
+/* a report is at least a single changed value and SYN_REPORT */
+#define NW_SER_MAXREPORTS	(NW_SER_EVBUFSIZE / 2)
+
+struct nwreport {
+	int x, y;
+	int button;
+	uint64_t ts; /* read time */
+};
+
+struct nwqueue {
+	struct nwreport *r;
+	unsigned int size; /* power of 2 */
+	unsigned int head; /* consumer, free running */
+	unsigned int tail; /* producer, free running */
+	int efd; /* eventfd to wake up the emitter thread */
+	/* producer side */
+	unsigned int kicked; /* tail at last wakeup */
+	int button; /* of last report */
+	struct nwreport *stash; /* transitions not queued */
+	int stash_pos, stash_len, stash_size;
+	struct nwreport hold; /* latest motion not queued */
+	int held;
+	unsigned long pushed;
+	unsigned long long depth_sum;
+	unsigned int depth_max;
+	unsigned long dropped; /* motion reports */
+	unsigned long stashed; /* transitions */
+	unsigned long lost; /* transitions, out of memory for stash */
+};
 
 struct nwserial {
+	char *device;
 	int fd;
 	struct termios orig_tio;
-	unsigned char buf[NW_SER_BUFSIZE];
-	int buf_pos;
-	int footer_pos;
+	int orig_serial_flags; /* -1 if not changed */
+	unsigned char *buf; /* ring buffer */
+	unsigned int bufsize; /* power of 2 */
+	unsigned int head; /* start of unparsed data, free running */
+	unsigned int tail; /* end of valid data, free running */
+	unsigned char frame[NW_SER_FRAMELEN]; /* frame wrapping end of buf */
+	FILE *rec; /* record file */
+	uint64_t rec_last; /* time of last recorded chunk */
+	struct {
+		unsigned long wakeups;
+		unsigned long frames;
+		unsigned long long bytes;
+		unsigned int max;
+		unsigned long hist[NW_SER_HISTSIZE]; /* log2 bytes per wakeup */
+		unsigned long types[256]; /* frames per type byte */
+	} stats;
+	struct nwserial_errors {
+		unsigned long sync_lost;
+		unsigned long dropped; /* bytes */
+		unsigned long unknown; /* packets of unknown type */
+		unsigned long usb; /* USB cable connected packets */
+		unsigned char last_unknown;
+	} err, err_logged; /* total, and at time of last summary */
+	uint64_t err_time; /* time of last summary */
+	struct {
+		uint64_t read; /* time of last read */
+		uint64_t last; /* read time of previous touch packet */
+		struct nwhist decode; /* read -> decode */
+		struct nwhist emit; /* read -> uinput write */
+		struct nwhist interval; /* inter-arrival of touch packets */
+		struct nwhist reconnect; /* disconnect -> reopened */
+	} lat;
+	struct {
+		int enabled;
+		int delay; /* ms until next attempt, doubled every failure */
+		uint64_t lost; /* time of disconnect */
+		uint64_t next; /* time of next attempt */
+		unsigned long attempts;
+		unsigned long count; /* successful reconnects */
+	} reconnect;
 	uint32_t serial;
 	uint32_t version;
+	struct {
+		int timeout; /* ms, in total */
+		int retries; /* extra queries within timeout */
+	} info;
 	int ufd; /* uinput node */
+	struct nwqueue *q; /* to emitter thread, if any */
+	struct input_event ev[NW_SER_EVBUFSIZE];
+	int ev_pos;
+	uint64_t rep_ts[NW_SER_MAXREPORTS]; /* read time of queued reports */
+	int rep_pos;
+	struct {
+		int valid; /* values below have been reported to uinput */
+		int x, y;
+		int left, right;
+		unsigned long suppressed; /* reports without changes */
+	} last;
+	struct {
+		int enabled;
+		int64_t m[6]; /* Q16 matrix, translation in units */
+		char *file; /* reloaded on SIGHUP */
+	} xform;
+	struct {
+		uint32_t mincutoff; /* Q16 Hz, 0 = filter disabled */
+		uint32_t beta; /* Q16 Hz per unit/s of speed */
+		int deadzone;
+		int valid; /* state below is valid */
+		int button;
+		uint64_t t; /* time of last sample */
+		int64_t x, y; /* filtered position, Q16 */
+		int64_t dx, dy; /* filtered speed, units/s */
+		int outx, outy; /* last output position */
+	} filter;
+	struct {
+		uint64_t interval; /* min ns between motion reports, 0 = off */
+		uint64_t last; /* time of last report */
+		int button; /* last reported button, -1 = none yet */
+		int pending; /* motion report held back */
+		int x, y; /* latest position */
+		unsigned long coalesced;
+	} motion;
 };
 
-static int nw_uinput_open(void)
+static volatile sig_atomic_t nw_serial_quit;
+static volatile sig_atomic_t nw_serial_dump;
+static volatile sig_atomic_t nw_serial_reload;
+
+/* monotonic time in ns */
+static uint64_t nw_serial_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int nw_uinput_open(const char *phys)
 {
 	struct uinput_user_dev uinput;
 	static const int ev_bits[] = { EV_SYN, EV_KEY, EV_ABS };
@@ -60,7 +229,7 @@ static int nw_uinput_open(void)
 		return -1;
 	}
 
-	if (ioctl(fd, UI_SET_PHYS, "ttySx"))
+	if (ioctl(fd, UI_SET_PHYS, phys))
 		perror("UI_SET_PHYS");
 
 	for (i=0; i< sizeof(ev_bits)/sizeof(ev_bits[0]); i++)
@@ -91,7 +260,7 @@ static int nw_uinput_open(void)
 	uinput.id.product = 0;
 	uinput.id.version = 0;
 	uinput.absmin[ABS_X]  = uinput.absmin[ABS_Y]  = 0;
-	uinput.absmax[ABS_X]  = uinput.absmax[ABS_Y]  = 32767;
+	uinput.absmax[ABS_X]  = uinput.absmax[ABS_Y]  = NW_SER_MAXCOORD;
 	uinput.absfuzz[ABS_X] = uinput.absfuzz[ABS_Y] = 0;
 	uinput.absflat[ABS_X] = uinput.absflat[ABS_Y] = 0;
 
@@ -118,40 +287,364 @@ static void nw_uinput_close(int fd)
 	close(fd);
 }
 
-static void nw_uinput_action(int fd, int x, int y, int button)
+/* write all queued events to uinput in a single syscall */
+static void nw_uinput_write(struct nwserial *nw)
 {
-	struct input_event ev[5];
-	int i;
+	uint64_t now;
+	int i, len;
+
+	if (!nw->ev_pos)
+		return;
+
+	len = nw->ev_pos * sizeof(nw->ev[0]);
+	if (write(nw->ufd, nw->ev, len) != len)
+		perror("uinput_action");
+
+	now = nw_serial_now();
+	for (i=0; i<nw->rep_pos; i++)
+		nw_hist_add(&nw->lat.emit, now - nw->rep_ts[i]);
+
+	nw->ev_pos = nw->rep_pos = 0;
+}
+
+static void nw_uinput_event(struct nwserial *nw, int type, int code, int value)
+{
+	struct input_event *ev;
+
+	ev = &nw->ev[nw->ev_pos++];
+	memset(ev, 0, sizeof(*ev));
+	ev->type  = type;
+	ev->code  = code;
+	ev->value = value;
+}
+
+/* queue events for the values that changed since the last report (if
+   any), read at time ts */
+static void nw_uinput_emit(struct nwserial *nw, int x, int y, int button,
+			   uint64_t ts)
+{
+	int left = (button == 1), right = (button == 2), start;
+
+	if (nw->ev_pos + NW_SER_REPORTLEN > NW_SER_EVBUFSIZE)
+		nw_uinput_write(nw);
+
+	start = nw->ev_pos;
+
+	if (!nw->last.valid || x != nw->last.x)
+		nw_uinput_event(nw, EV_ABS, ABS_X, x);
+	if (!nw->last.valid || y != nw->last.y)
+		nw_uinput_event(nw, EV_ABS, ABS_Y, y);
+	if (!nw->last.valid || left != nw->last.left)
+		nw_uinput_event(nw, EV_KEY, BTN_LEFT, left);
+	if (!nw->last.valid || right != nw->last.right)
+		nw_uinput_event(nw, EV_KEY, BTN_RIGHT, right);
+
+	if (nw->ev_pos == start) {
+		nw->last.suppressed++;
+		return;
+	}
+
+	nw_uinput_event(nw, EV_SYN, SYN_REPORT, 0);
+	nw->rep_ts[nw->rep_pos++] = ts;
+
+	nw->last.valid = 1;
+	nw->last.x = x;
+	nw->last.y = y;
+	nw->last.left = left;
+	nw->last.right = right;
+}
+
+/*
+ * Optional single producer / single consumer queue of reports between
+ * the reader (producer) and a separate emitter thread (consumer), so a
+ * stalling uinput write doesn't stop the tty from being drained.
+ *
+ * When the queue is full, motion reports are dropped (only the latest is
+ * kept and sent once there's space again), while button transitions are
+ * stashed on the producer side and sent in order later. The stash grows
+ * as needed, so transitions are only lost if memory runs out.
+ */
+static int nw_queue_put(struct nwqueue *q, const struct nwreport *r)
+{
+	unsigned int head, depth;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	depth = q->tail - head;
+	if (depth == q->size)
+		return 0;
+
+	q->r[q->tail & (q->size - 1)] = *r;
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+
+	q->pushed++;
+	q->depth_sum += depth;
+	if (depth + 1 > q->depth_max)
+		q->depth_max = depth + 1;
+
+	return 1;
+}
+
+static int nw_queue_get(struct nwqueue *q, struct nwreport *r)
+{
+	unsigned int tail;
+
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (tail == q->head)
+		return 0;
+
+	*r = q->r[q->head & (q->size - 1)];
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* move stashed transitions and held back motion into the queue, returns
+   non-zero if anything is still left */
+static int nw_queue_drain(struct nwqueue *q)
+{
+	while (q->stash_pos < q->stash_len
+	       && nw_queue_put(q, &q->stash[q->stash_pos]))
+		q->stash_pos++;
+
+	if (q->stash_pos < q->stash_len)
+		return 1;
+
+	q->stash_pos = q->stash_len = 0;
+
+	if (q->held && nw_queue_put(q, &q->hold))
+		q->held = 0;
+
+	return q->held;
+}
+
+/* keep back transition r until there's space in the queue */
+static void nw_queue_stash(struct nwqueue *q, const struct nwreport *r)
+{
+	struct nwreport *stash;
+	int size;
+
+	if (q->stash_len == q->stash_size) {
+		if (q->stash_pos) {
+			memmove(q->stash, q->stash + q->stash_pos,
+				(q->stash_len - q->stash_pos) * sizeof(*r));
+			q->stash_len -= q->stash_pos;
+			q->stash_pos = 0;
+		} else {
+			size = q->stash_size ? q->stash_size * 2
+				: NW_SER_STASHSIZE;
+			stash = realloc(q->stash, size * sizeof(*stash));
+			if (!stash) {
+				q->lost++;
+				return;
+			}
+			q->stash = stash;
+			q->stash_size = size;
+		}
+	}
+
+	q->stash[q->stash_len++] = *r;
+	q->stashed++;
+}
+
+static void nw_queue_push(struct nwqueue *q, const struct nwreport *r)
+{
+	int transition = (r->button != q->button);
+
+	q->button = r->button;
+
+	if (!nw_queue_drain(q) && nw_queue_put(q, r))
+		return;
+
+	/* full, older motion is superseded by this report */
+	if (q->held) {
+		q->held = 0;
+		q->dropped++;
+	}
+
+	if (!transition) {
+		q->hold = *r;
+		q->held = 1;
+	} else {
+		nw_queue_stash(q, r);
+	}
+}
+
+/* queue a report, flushed by nw_serial_process() once the complete read
+   has been parsed */
+static void nw_uinput_action(struct nwserial *nw, int x, int y, int button)
+{
+	struct nwreport r;
+
+	if (!nw->q) {
+		nw_uinput_emit(nw, x, y, button, nw->lat.read);
+		return;
+	}
+
+	r.x = x;
+	r.y = y;
+	r.button = button;
+	r.ts = nw->lat.read;
+	nw_queue_push(nw->q, &r);
+}
+
+static void nw_uinput_flush(struct nwserial *nw)
+{
+	uint64_t one = 1;
+
+	if (!nw->q) {
+		nw_uinput_write(nw);
+		return;
+	}
+
+	/* wake up emitter thread */
+	if (nw->q->tail != nw->q->kicked) {
+		nw->q->kicked = nw->q->tail;
+		if (write(nw->q->efd, &one, sizeof(one)) != sizeof(one))
+			perror("eventfd");
+	}
+}
+
+/* apply affine calibration transform */
+static void nw_serial_transform(struct nwserial *nw, int *x, int *y)
+{
+	int64_t *m = nw->xform.m;
+	int64_t tx, ty;
+
+	if (!nw->xform.enabled)
+		return;
+
+	tx = (m[0] * *x + m[1] * *y + m[2]) >> 16;
+	ty = (m[3] * *x + m[4] * *y + m[5]) >> 16;
+
+	*x = tx < 0 ? 0 : tx > NW_SER_MAXCOORD ? NW_SER_MAXCOORD : tx;
+	*y = ty < 0 ? 0 : ty > NW_SER_MAXCOORD ? NW_SER_MAXCOORD : ty;
+}
+
+/* Q16 smoothing factor of a first order low pass filter with cutoff
+   frequency (Q16 Hz) for a sample interval dt (ns) */
+static int64_t nw_filter_alpha(uint64_t cutoff, uint64_t dt)
+{
+	uint64_t tau;
+
+	/* tau = 1 / (2 * pi * cutoff), 159154943 = 1e9 / (2 * pi) */
+	tau = 159154943ULL * 65536 / cutoff;
+
+	return (dt << 16) / (dt + tau);
+}
 
-	memset(&ev, 0, sizeof(ev));
+/* one euro filter: low pass with a cutoff frequency increasing with
+   speed, so jitter at rest is smoothed out while fast strokes don't lag */
+static int nw_filter_axis(struct nwserial *nw, int64_t *pos, int64_t *speed,
+			  int raw, uint64_t dt)
+{
+	int64_t d, alpha;
+	uint64_t cutoff;
+
+	d = (((int64_t)raw << 16) - *pos) * 1000000000 / (int64_t)dt;
+	*speed += nw_filter_alpha(NW_SER_DCUTOFF, dt) * ((d >> 16) - *speed)
+		>> 16;
+
+	cutoff = nw->filter.mincutoff
+		+ (uint64_t)nw->filter.beta * llabs(*speed);
+	alpha = nw_filter_alpha(cutoff, dt);
+	*pos += (alpha * (((int64_t)raw << 16) - *pos)) >> 16;
+
+	return (*pos + (1 << 15)) >> 16;
+}
+
+static void nw_serial_filter(struct nwserial *nw, int *x, int *y, int button)
+{
+	uint64_t dt;
+	int fx, fy;
+
+	if (!nw->filter.mincutoff)
+		return;
+
+	/* restart on button transitions, so taps land exactly */
+	if (!nw->filter.valid || button != nw->filter.button) {
+		nw->filter.valid = 1;
+		nw->filter.button = button;
+		nw->filter.t = nw->lat.read;
+		nw->filter.x = (int64_t)*x << 16;
+		nw->filter.y = (int64_t)*y << 16;
+		nw->filter.dx = nw->filter.dy = 0;
+		nw->filter.outx = *x;
+		nw->filter.outy = *y;
+		return;
+	}
+
+	/* frames from a single read get the same timestamp, but cannot
+	   arrive faster than the line speed */
+	dt = nw->lat.read - nw->filter.t;
+	if (dt < NW_SER_FRAMETIME)
+		dt = NW_SER_FRAMETIME;
+	nw->filter.t = nw->lat.read;
+
+	fx = nw_filter_axis(nw, &nw->filter.x, &nw->filter.dx, *x, dt);
+	fy = nw_filter_axis(nw, &nw->filter.y, &nw->filter.dy, *y, dt);
+
+	/* only move once outside of the dead zone around the last output */
+	if (abs(fx - nw->filter.outx) > nw->filter.deadzone
+	    || abs(fy - nw->filter.outy) > nw->filter.deadzone) {
+		nw->filter.outx = fx;
+		nw->filter.outy = fy;
+	}
+
+	*x = nw->filter.outx;
+	*y = nw->filter.outy;
+}
+
+/* button transitions are reported right away, position only updates at
+   most every motion.interval with the latest position */
+static void nw_serial_report(struct nwserial *nw, int x, int y, int button)
+{
+	if (nw->motion.interval && button == nw->motion.button
+	    && nw->lat.read - nw->motion.last < nw->motion.interval) {
+		if (nw->motion.pending)
+			nw->motion.coalesced++;
+
+		nw->motion.pending = 1;
+		nw->motion.x = x;
+		nw->motion.y = y;
+		return;
+	}
+
+	/* a pending motion report is superseded by this one */
+	if (nw->motion.pending) {
+		nw->motion.coalesced++;
+		nw->motion.pending = 0;
+	}
 
-	ev[0].type  = EV_ABS;
-	ev[0].code  = ABS_X;
-	ev[0].value = x;
+	nw->motion.x = x;
+	nw->motion.y = y;
+	nw_uinput_action(nw, x, y, button);
+	nw->motion.button = button;
+	nw->motion.last = nw->lat.read;
+}
 
-	ev[1].type  = EV_ABS;
-	ev[1].code  = ABS_Y;
-	ev[1].value = y;
+/* send held back motion report if due, and return ms until the next one
+   is due, or -1 if nothing is pending */
+static int nw_serial_motion_due(struct nwserial *nw, uint64_t now)
+{
+	uint64_t due;
 
-	ev[2].type  = EV_KEY;
-	ev[2].code  = BTN_LEFT;
-	ev[2].value = (button == 1);
+	if (!nw->motion.pending)
+		return -1;
 
-	ev[3].type  = EV_KEY;
-	ev[3].code  = BTN_RIGHT;
-	ev[3].value = (button == 2);
+	due = nw->motion.last + nw->motion.interval;
+	if (now < due)
+		return (due - now + 999999) / 1000000;
 
-	ev[4].type  = EV_SYN;
-	ev[4].code  = SYN_REPORT;
-	ev[4].value = 0;
+	nw->motion.pending = 0;
+	nw->motion.last = now;
+	nw_uinput_action(nw, nw->motion.x, nw->motion.y, nw->motion.button);
+	nw_uinput_flush(nw);
 
-	/* kernel requires seperate write(2) syscall for each event */
-	for (i=0; i<sizeof(ev)/sizeof(ev[0]); i++)
-		if (write(fd, &ev[i], sizeof(ev[i])) != sizeof(ev[i]))
-			perror("uinput_action");
+	return -1;
 }
 
-static void nw_serial_handle_packet(struct nwserial *nw)
+static void nw_serial_handle_packet(struct nwserial *nw,
+				    const unsigned char *pkt)
 {
 	float x, y;
 	uint32_t xi, yi;
@@ -164,15 +657,15 @@ static void nw_serial_handle_packet(struct nwserial *nw)
 	   b9..14: footer '<END>\r'
 	*/
 
-	memcpy(&xi, nw->buf+0, sizeof(xi));
+	memcpy(&xi, pkt+0, sizeof(xi));
 	xi = ntohl(xi); x = *(float*)&xi;
-	memcpy(&yi, nw->buf+4, sizeof(yi));
+	memcpy(&yi, pkt+4, sizeof(yi));
 	yi = ntohl(yi); y = *(float*)&yi;
-	type = nw->buf[8];
+	type = pkt[8];
 
 	switch (type) {
 	case 0x75:
-		fprintf(stderr, "USB cable connected, please disconnect\n");
+		nw->err.usb++;
 		break;
 
 	case 0x73: /* ts info */
@@ -190,107 +683,401 @@ static void nw_serial_handle_packet(struct nwserial *nw)
 	case 0x0b:
 	case 0x0c:
 		key = type % 10;
+
+		nw_hist_add(&nw->lat.decode, nw_serial_now() - nw->lat.read);
+		if (nw->lat.last)
+			nw_hist_add(&nw->lat.interval,
+				    nw->lat.read - nw->lat.last);
+		nw->lat.last = nw->lat.read;
+
 #ifdef NW_SER_VERBOSE
 		printf("Action %s LCD, x=%.0f, y=%.0f %s (%u)\n",
 		       (type >= 0x0a) ? "outside" : "inside", x, y,
 		       key ? (key==2) ? "right" : "left" : "", key);
 #endif /* NW_SER_VERBOSE */
-		if (nw->ufd != -1)
-			nw_uinput_action(nw->ufd, (int)x, (int)y, key);
+		if (nw->ufd != -1) {
+			int ix = x, iy = y;
+
+			nw_serial_transform(nw, &ix, &iy);
+			nw_serial_filter(nw, &ix, &iy, key);
+			nw_serial_report(nw, ix, iy, key);
+		}
 		break;
 
 	default:
-		fprintf(stderr, "Unknown packet 0x%02x, x=%u, y=%u\n",
-			type, xi, yi);
+		nw->err.unknown++;
+		nw->err.last_unknown = type;
 		break;
 	}
 }
 
-static int nw_serial_process(struct nwserial *nw)
+/* does the footer start at ring position pos? */
+static int nw_serial_is_footer(struct nwserial *nw, unsigned int pos)
 {
-	static const char footer[] = "<END>\r";
-	int length;
+	static const char footer[] = NW_SER_FOOTER;
+	unsigned int i;
 
-	length = read(nw->fd, &nw->buf[nw->buf_pos],
-		      sizeof(nw->buf) - nw->buf_pos);
-	if (length == -1) {
-		perror("read");
-		return 1;
-	}
+	for (i=0; i<NW_SER_FOOTERLEN; i++)
+		if (nw->buf[(pos + i) & (nw->bufsize - 1)] != footer[i])
+			return 0;
 
-	if (length == 0)
-		return 2; /* eof, disconnected */
+	return 1;
+}
 
-	while (length) {
-		if (nw->buf_pos >= sizeof(nw->buf)) {
-			fprintf(stderr, "Overflow, resetting buffer\n");
-			nw->buf_pos = nw->footer_pos = 0;
-		}
+/* return frame starting at ring position pos as a linear buffer */
+static const unsigned char *nw_serial_frame(struct nwserial *nw,
+					    unsigned int pos)
+{
+	unsigned int idx, len;
 
-		nw->buf_pos++;
+	idx = pos & (nw->bufsize - 1);
+	len = nw->bufsize - idx;
+	if (len >= NW_SER_FRAMELEN)
+		return nw->buf + idx;
 
-		if (nw->buf[nw->buf_pos-1] == footer[nw->footer_pos]) {
-			nw->footer_pos++;
+	memcpy(nw->frame, nw->buf + idx, len);
+	memcpy(nw->frame + len, nw->buf, NW_SER_FRAMELEN - len);
+	return nw->frame;
+}
 
-			if (nw->footer_pos == sizeof(footer)-1) {
-				nw_serial_handle_packet(nw);
-				memmove(nw->buf, &nw->buf[nw->buf_pos],
-					sizeof(nw->buf) - nw->buf_pos);
-				nw->buf_pos = nw->footer_pos = 0;
-			}
-		} else {
-			nw->footer_pos = 0;
+/* drop unparsed data up to ring position pos */
+static void nw_serial_drop(struct nwserial *nw, unsigned int pos)
+{
+	if ((int)(pos - nw->head) <= 0)
+		return;
+
+	nw->err.sync_lost++;
+	nw->err.dropped += pos - nw->head;
+	nw->head = pos;
+}
+
+/* find next frame in the ring and return it, or NULL if no complete frame
+   is available. Data in front of the frame is dropped */
+static const unsigned char *nw_serial_next_frame(struct nwserial *nw)
+{
+	unsigned int start, p, idx, len;
+	unsigned char *c;
+
+	start = nw->head;
+	if (nw->tail - start < NW_SER_FRAMELEN)
+		return NULL;
+
+	/* fast path: in sync, footer at expected offset */
+	if (nw_serial_is_footer(nw, start + NW_SER_PAYLOADLEN)) {
+		nw->head += NW_SER_FRAMELEN;
+		return nw_serial_frame(nw, start);
+	}
+
+	/* out of sync, scan for a complete footer, one contiguous part of
+	   the ring at a time */
+	p = start + NW_SER_PAYLOADLEN + 1;
+	while (nw->tail - p >= NW_SER_FOOTERLEN) {
+		idx = p & (nw->bufsize - 1);
+		len = nw->tail - p - (NW_SER_FOOTERLEN - 1);
+		if (len > nw->bufsize - idx)
+			len = nw->bufsize - idx;
+
+		c = memchr(nw->buf + idx, '<', len);
+		if (!c) {
+			p += len;
+			continue;
+		}
+
+		p += c - (nw->buf + idx);
+		if (nw_serial_is_footer(nw, p)) {
+			start = p - NW_SER_PAYLOADLEN;
+			nw_serial_drop(nw, start);
+			nw->head = p + NW_SER_FOOTERLEN;
+			return nw_serial_frame(nw, start);
 		}
 
-		length--;
+		p++;
 	}
 
-	return 0;
+	/* no footer found, only the last bytes can be part of a frame */
+	nw_serial_drop(nw, p - NW_SER_PAYLOADLEN);
+
+	return NULL;
 }
 
-static int nw_serial_get_info(struct nwserial *nw)
+/* read as much as fits in the ring, wrapping around the end if needed */
+static int nw_serial_read(struct nwserial *nw)
+{
+	struct iovec iov[2];
+	unsigned int idx, avail;
+
+	idx = nw->tail & (nw->bufsize - 1);
+	avail = nw->bufsize - (nw->tail - nw->head);
+
+	iov[0].iov_base = nw->buf + idx;
+	iov[0].iov_len = nw->bufsize - idx;
+	if (iov[0].iov_len > avail)
+		iov[0].iov_len = avail;
+
+	iov[1].iov_base = nw->buf;
+	iov[1].iov_len = avail - iov[0].iov_len;
+
+	return readv(nw->fd, iov, iov[1].iov_len ? 2 : 1);
+}
+
+static void nw_serial_account(struct nwserial *nw, unsigned int bytes)
+{
+	int bucket;
+
+	nw->stats.wakeups++;
+	nw->stats.bytes += bytes;
+	if (bytes > nw->stats.max)
+		nw->stats.max = bytes;
+
+	for (bucket = 0; bytes > 1 && bucket < NW_SER_HISTSIZE-1; bucket++)
+		bytes >>= 1;
+
+	nw->stats.hist[bucket]++;
+}
+
+/* line errors are only counted on the hot path, and summarized at most
+   every NW_SER_LOGINTERVAL so a noisy line cannot flood the log */
+static void nw_serial_log_errors(struct nwserial *nw)
+{
+	struct nwserial_errors *e = &nw->err, *l = &nw->err_logged;
+
+	if (e->sync_lost == l->sync_lost && e->unknown == l->unknown
+	    && e->usb == l->usb)
+		return;
+
+	if (nw->err_time && nw->lat.read - nw->err_time < NW_SER_LOGINTERVAL)
+		return;
+
+	if (e->usb != l->usb)
+		fprintf(stderr, "%s: USB cable connected, please disconnect\n",
+			nw->device);
+
+	if (e->sync_lost != l->sync_lost)
+		fprintf(stderr, "%s: lost sync %lu times, dropped %lu bytes\n",
+			nw->device, e->sync_lost - l->sync_lost,
+			e->dropped - l->dropped);
+
+	if (e->unknown != l->unknown)
+		fprintf(stderr, "%s: %lu unknown packets (last 0x%02x)\n",
+			nw->device, e->unknown - l->unknown, e->last_unknown);
+
+	*l = *e;
+	nw->err_time = nw->lat.read;
+}
+
+static void nw_serial_show_stats(struct nwserial *nw)
 {
 	int i;
 
-	nw->serial = nw->version = 0xdeadbeef;
+	if (!nw->stats.wakeups)
+		return;
+
+	fprintf(stderr, "%s: read %llu bytes, %lu frames in %lu wakeups "
+		"(avg %.1f, max %u)\n", nw->device,
+		nw->stats.bytes, nw->stats.frames, nw->stats.wakeups,
+		(double)nw->stats.bytes / nw->stats.wakeups, nw->stats.max);
+
+	for (i=0; i<NW_SER_HISTSIZE; i++)
+		if (nw->stats.hist[i])
+			fprintf(stderr, "  %5u-%-5u bytes:\t%lu\n",
+				1u << i, (2u << i) - 1, nw->stats.hist[i]);
+
+	for (i=0; i<256; i++)
+		if (nw->stats.types[i])
+			fprintf(stderr, "  type 0x%02x:\t\t%lu\n", i,
+				nw->stats.types[i]);
+
+	if (nw->last.suppressed)
+		fprintf(stderr, "  suppressed reports:\t%lu\n",
+			nw->last.suppressed);
+
+	if (nw->q && nw->q->pushed) {
+		fprintf(stderr, "  queued reports:\t%lu (avg depth %.1f, "
+			"max %u)\n", nw->q->pushed,
+			(double)nw->q->depth_sum / nw->q->pushed,
+			nw->q->depth_max);
+		fprintf(stderr, "  queue full:\t\t%lu motion dropped, "
+			"%lu transitions delayed, %lu lost\n",
+			nw->q->dropped, nw->q->stashed, nw->q->lost);
+	}
 
-	if (write(nw->fd, "nwgs\r", 5) == -1) {
-		perror("write");
-		return 1;
+	if (nw->reconnect.attempts)
+		fprintf(stderr, "  reconnects:\t\t%lu (%lu attempts)\n",
+			nw->reconnect.count, nw->reconnect.attempts);
+
+	if (nw->motion.coalesced)
+		fprintf(stderr, "  coalesced motion:\t%lu\n",
+			nw->motion.coalesced);
+
+	if (nw->err.sync_lost)
+		fprintf(stderr, "  lost sync:\t\t%lu (%lu bytes)\n",
+			nw->err.sync_lost, nw->err.dropped);
+
+	nw_hist_show(&nw->lat.decode, "decode", stderr);
+	nw_hist_show(&nw->lat.emit, "emit", stderr);
+	nw_hist_show(&nw->lat.interval, "interval", stderr);
+	nw_hist_show(&nw->lat.reconnect, "reconnect", stderr);
+}
+
+/* parse all complete frames in the ring */
+static void nw_serial_parse(struct nwserial *nw)
+{
+	const unsigned char *pkt;
+
+	while ((pkt = nw_serial_next_frame(nw))) {
+		nw->stats.frames++;
+		nw->stats.types[pkt[8]]++;
+		nw_serial_handle_packet(nw, pkt);
 	}
+}
+
+/* parse data from memory instead of the tty. Data may be bigger than
+   the ring, so it is copied in and parsed piece by piece */
+static void nw_serial_feed(struct nwserial *nw, const unsigned char *data,
+			   unsigned int len)
+{
+	unsigned int idx, avail, pos, n;
+
+	for (pos = 0; pos < len; pos += n) {
+		idx = nw->tail & (nw->bufsize - 1);
+		avail = nw->bufsize - (nw->tail - nw->head);
+		n = len - pos;
+		if (n > avail)
+			n = avail;
+		if (n > nw->bufsize - idx)
+			n = nw->bufsize - idx;
+
+		memcpy(nw->buf + idx, data + pos, n);
+		nw->tail += n;
+		nw_serial_parse(nw);
+	}
+}
+
+/* append len bytes at ring position pos to the record file */
+static void nw_serial_record(struct nwserial *nw, unsigned int pos,
+			     unsigned int len)
+{
+	uint32_t hdr[2];
+	uint64_t delta;
+	unsigned int idx, first;
+
+	delta = (nw->lat.read - nw->rec_last) / 1000;
+	if (!nw->rec_last || delta > UINT32_MAX)
+		delta = 0;
+	nw->rec_last = nw->lat.read;
+
+	hdr[0] = htonl(delta);
+	hdr[1] = htonl(len);
+
+	idx = pos & (nw->bufsize - 1);
+	first = nw->bufsize - idx;
+	if (first > len)
+		first = len;
+
+	if (fwrite(hdr, sizeof(hdr), 1, nw->rec) != 1
+	    || fwrite(nw->buf + idx, 1, first, nw->rec) != first
+	    || fwrite(nw->buf, 1, len - first, nw->rec) != len - first) {
+		perror("record");
+		fclose(nw->rec);
+		nw->rec = 0;
+	}
+}
+
+/* read everything pending on the tty and parse it */
+static int nw_serial_process(struct nwserial *nw)
+{
+	int length, pending, total = 0;
+
+	do {
+		length = nw_serial_read(nw);
+		if (length == -1) {
+			if (errno == EINTR)
+				return 0;
+
+			perror("read");
+			return 1;
+		}
+
+		if (length == 0)
+			return 2; /* eof, disconnected */
+
+		nw->lat.read = nw_serial_now();
+		if (nw->rec)
+			nw_serial_record(nw, nw->tail, length);
+
+		nw->tail += length;
+		total += length;
+
+		nw_serial_parse(nw);
+
+		if (ioctl(nw->fd, FIONREAD, &pending))
+			pending = 0;
+	} while (pending > 0);
+
+	nw_serial_account(nw, total);
+
+	if (nw->ufd != -1)
+		nw_uinput_flush(nw);
 
-	for (i=0; i<10; i++) {
-		fd_set fds;
-		struct timeval tv;
+	nw_serial_log_errors(nw);
+
+	return 0;
+}
+
+/* query serial number and firmware version, waiting until the response
+   is parsed or the deadline passes */
+static int nw_serial_get_info(struct nwserial *nw)
+{
+	struct pollfd pfd;
+	uint64_t start, deadline, now;
+	int try, n;
+
+	nw->serial = nw->version = 0xdeadbeef;
 
-		FD_ZERO(&fds);
-		FD_SET(nw->fd, &fds);
+	pfd.fd = nw->fd;
+	pfd.events = POLLIN;
 
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000;
+	start = nw_serial_now();
 
-		if (select(nw->fd + 1, &fds, 0, 0, &tv) == -1) {
-			perror("select");
+	/* with retries, the query is resent at equal intervals within the
+	   total timeout */
+	for (try = 0; try <= nw->info.retries; try++) {
+		if (write(nw->fd, "nwgs\r", 5) == -1) {
+			perror("write");
 			return 1;
 		}
 
-		if (FD_ISSET(nw->fd, &fds)) {
+		deadline = start + (uint64_t)nw->info.timeout * 1000000
+			* (try + 1) / (nw->info.retries + 1);
+
+		while ((now = nw_serial_now()) < deadline) {
+			n = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+
+				perror("poll");
+				return 1;
+			}
+
+			if (n == 0)
+				break;
+
 			if (nw_serial_process(nw))
 				return 1;
 
 			if (nw->serial != 0xdeadbeef
 			    || nw->version != 0xdeadbeef)
-				break;
+				return 0;
 		}
 	}
 
-	return (nw->serial == 0xdeadbeef && nw->version == 0xdeadbeef);
+	return 1;
 }
 
-struct nwserial *nw_serial_init(char *device)
+static struct nwserial *nw_serial_alloc(char *device)
 {
 	struct nwserial *nw;
-	struct termios tio;
 
 	nw = calloc(1, sizeof(struct nwserial));
 	if (!nw) {
@@ -298,17 +1085,52 @@ struct nwserial *nw_serial_init(char *device)
 		return 0;
 	}
 
-	nw->fd = open(device, O_RDWR);
-	if (nw->fd == -1) {
-		perror(device);
+	if (nw_serial_set_bufsize(nw, NW_SER_BUFSIZE)) {
 		free(nw);
 		return 0;
 	}
 
+	nw->device = device;
+	nw->fd = -1;
+	nw->orig_serial_flags = -1;
+	nw->ufd = -1;
+	nw->motion.button = -1;
+	nw->info.timeout = NW_SER_INFO_TIMEOUT;
+
+	return nw;
+}
+
+static void nw_serial_free(struct nwserial *nw)
+{
+	if (nw->rec)
+		fclose(nw->rec);
+
+	free(nw->xform.file);
+
+	if (nw->q) {
+		free(nw->q->stash);
+		free(nw->q->r);
+		free(nw->q);
+	}
+
+	free(nw->buf);
+	free(nw);
+}
+
+/* open and configure the tty */
+static int nw_serial_open(struct nwserial *nw)
+{
+	struct termios tio;
+
+	nw->fd = open(nw->device, O_RDWR);
+	if (nw->fd == -1) {
+		perror(nw->device);
+		return 1;
+	}
+
 	if (tcgetattr(nw->fd, &nw->orig_tio)) {
 		perror("tcgetattr");
-		free(nw);
-		return 0;
+		goto err_attr;
 	}
 
 	tio = nw->orig_tio;
@@ -323,32 +1145,361 @@ struct nwserial *nw_serial_init(char *device)
 
 	if (tcsetattr(nw->fd, TCSANOW, &tio)) {
 		perror("tcsetattr");
-		close(nw->fd);
-		free(nw);
-		return 0;
+		goto err_attr;
 	}
 
-	nw->ufd = -1;
-
-	return nw;
-}
+	return 0;
 
-void nw_serial_deinit(struct nwserial *nw)
-{
-	tcsetattr(nw->fd, TCSANOW, &nw->orig_tio);
+err_attr:
 	close(nw->fd);
-	free(nw);
+	nw->fd = -1;
+
+	return 1;
 }
 
-int nw_serial_show_info(struct nwserial *nw)
+struct nwserial *nw_serial_init(char *device)
+{
+	struct nwserial *nw;
+
+	nw = nw_serial_alloc(device);
+	if (!nw)
+		return 0;
+
+	if (nw_serial_open(nw)) {
+		nw_serial_free(nw);
+		return 0;
+	}
+
+	return nw;
+}
+
+void nw_serial_deinit(struct nwserial *nw)
+{
+	/* disconnected and not reopened */
+	if (nw->fd == -1) {
+		nw_serial_free(nw);
+		return;
+	}
+
+	if (nw->orig_serial_flags != -1) {
+		struct serial_struct ss;
+
+		if (!ioctl(nw->fd, TIOCGSERIAL, &ss)) {
+			ss.flags = nw->orig_serial_flags;
+			ioctl(nw->fd, TIOCSSERIAL, &ss);
+		}
+	}
+
+	tcsetattr(nw->fd, TCSANOW, &nw->orig_tio);
+	close(nw->fd);
+	nw_serial_free(nw);
+}
+
+/* record all data read from the device to file */
+int nw_serial_set_record(struct nwserial *nw, char *file)
+{
+	if (nw->rec)
+		fclose(nw->rec);
+
+	nw->rec = fopen(file, "wb");
+	if (!nw->rec) {
+		perror(file);
+		return 1;
+	}
+
+	if (fwrite(NW_SER_REC_MAGIC, NW_SER_REC_MAGICLEN, 1, nw->rec) != 1) {
+		perror(file);
+		fclose(nw->rec);
+		nw->rec = 0;
+		return 1;
+	}
+
+	nw->rec_last = 0;
+
+	return 0;
+}
+
+int nw_serial_set_bufsize(struct nwserial *nw, int size)
+{
+	unsigned char *buf;
+	unsigned int bufsize;
+
+	if (size < NW_SER_BUFSIZE_MIN || size > NW_SER_BUFSIZE_MAX) {
+		fprintf(stderr, "buffer size must be between %d and %d\n",
+			NW_SER_BUFSIZE_MIN, NW_SER_BUFSIZE_MAX);
+		return 1;
+	}
+
+	for (bufsize = NW_SER_BUFSIZE_MIN; bufsize < size; bufsize <<= 1)
+		;
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* any unparsed data is lost */
+	free(nw->buf);
+	nw->buf = buf;
+	nw->bufsize = bufsize;
+	nw->head = nw->tail = 0;
+
+	return 0;
+}
+
+/* report motion at most hz times per second, 0 = no limit */
+int nw_serial_set_motion_rate(struct nwserial *nw, int hz)
+{
+	if (hz < 0) {
+		fprintf(stderr, "invalid motion rate %d\n", hz);
+		return 1;
+	}
+
+	nw->motion.interval = hz ? 1000000000ULL / hz : 0;
+
+	return 0;
+}
+
+/* parse 6 numbers of a 2x3 matrix separated by commas or white space */
+static int nw_serial_parse_matrix(const char *str, double *m)
+{
+	char *endp;
+	int i;
+
+	for (i=0; i<6; i++) {
+		m[i] = strtod(str, &endp);
+		if (endp == str)
+			return 1;
+
+		str = endp + strspn(endp, ", \t\r\n");
+	}
+
+	return *str != 0;
+}
+
+/* calibration matrix is a b c d e f, as in x' = a*x + b*y + c and
+   y' = d*x + e*y + f, with c/f relative to the coordinate range (like the
+   libinput calibration matrix) */
+int nw_serial_set_transform(struct nwserial *nw, char *matrix)
+{
+	double m[6];
+	int i;
+
+	if (nw_serial_parse_matrix(matrix, m)) {
+		fprintf(stderr, "invalid calibration matrix '%s'\n", matrix);
+		return 1;
+	}
+
+	for (i=0; i<6; i++) {
+		if (m[i] < -16 || m[i] > 16) {
+			fprintf(stderr, "calibration matrix value out of "
+				"range\n");
+			return 1;
+		}
+
+		if (i == 2 || i == 5)
+			m[i] *= NW_SER_MAXCOORD;
+
+		nw->xform.m[i] = m[i] * 65536;
+	}
+
+	nw->xform.enabled = 1;
+
+	return 0;
+}
+
+static int nw_serial_load_transform(struct nwserial *nw)
+{
+	char buf[256], matrix[256] = "";
+	FILE *f;
+
+	f = fopen(nw->xform.file, "r");
+	if (!f) {
+		perror(nw->xform.file);
+		return 1;
+	}
+
+	/* matrix may span multiple lines, # starts a comment */
+	while (fgets(buf, sizeof(buf), f)) {
+		buf[strcspn(buf, "#")] = 0;
+		if (strlen(matrix) + strlen(buf) + 2 > sizeof(matrix))
+			break;
+		strcat(matrix, " ");
+		strcat(matrix, buf);
+	}
+
+	fclose(f);
+
+	return nw_serial_set_transform(nw, matrix);
+}
+
+/* load calibration matrix from file, and reload it on SIGHUP */
+int nw_serial_set_transform_file(struct nwserial *nw, char *file)
+{
+	free(nw->xform.file);
+
+	nw->xform.file = strdup(file);
+	if (!nw->xform.file) {
+		perror("malloc");
+		return 1;
+	}
+
+	return nw_serial_load_transform(nw);
+}
+
+/* smooth coordinates with a one euro filter with min cutoff frequency
+   mincutoff (Hz, 0 = disabled), speed coefficient beta, and a dead zone
+   of deadzone units */
+int nw_serial_set_filter(struct nwserial *nw, double mincutoff, double beta,
+			 int deadzone)
+{
+	if (mincutoff < 0 || mincutoff > 1000 || beta < 0 || beta > 1000
+	    || deadzone < 0) {
+		fprintf(stderr, "invalid filter parameters\n");
+		return 1;
+	}
+
+	nw->filter.mincutoff = mincutoff * 65536;
+	nw->filter.beta = beta * 65536;
+	nw->filter.deadzone = deadzone;
+	nw->filter.valid = 0;
+
+	return 0;
+}
+
+/* total time to wait for info responses, and extra queries to send */
+int nw_serial_set_info_timeout(struct nwserial *nw, int ms, int retries)
+{
+	if (ms <= 0 || retries < 0 || retries >= ms) {
+		fprintf(stderr, "invalid info timeout %d:%d\n", ms, retries);
+		return 1;
+	}
+
+	nw->info.timeout = ms;
+	nw->info.retries = retries;
+
+	return 0;
+}
+
+/* reopen the device if it gets disconnected while forwarding */
+int nw_serial_set_reconnect(struct nwserial *nw)
+{
+	nw->reconnect.enabled = 1;
+
+	return 0;
+}
+
+/* decouple reading from writing to uinput with a queue of size reports
+   to a separate emitter thread */
+int nw_serial_set_queue(struct nwserial *nw, int size)
+{
+	struct nwqueue *q;
+	unsigned int qsize;
+
+	if (size < 16 || size > 65536) {
+		fprintf(stderr, "queue size must be between 16 and 65536\n");
+		return 1;
+	}
+
+	for (qsize = 16; qsize < size; qsize <<= 1)
+		;
+
+	q = calloc(1, sizeof(*q));
+	if (!q) {
+		perror("malloc");
+		return 1;
+	}
+
+	q->r = calloc(qsize, sizeof(q->r[0]));
+	if (!q->r) {
+		perror("malloc");
+		free(q);
+		return 1;
+	}
+
+	q->size = qsize;
+	q->efd = -1;
+	q->button = -1;
+
+	if (nw->q) {
+		free(nw->q->stash);
+		free(nw->q->r);
+		free(nw->q);
+	}
+	nw->q = q;
+
+	return 0;
+}
+
+/* ask the driver to push received data to the tty layer immediately
+   instead of batching it up in the flip buffer */
+int nw_serial_set_low_latency(struct nwserial *nw)
+{
+	struct serial_struct ss;
+
+	if (ioctl(nw->fd, TIOCGSERIAL, &ss)) {
+		fprintf(stderr, "%s: low latency mode not supported by "
+			"driver\n", nw->device);
+		return 1;
+	}
+
+	if (nw->orig_serial_flags == -1)
+		nw->orig_serial_flags = ss.flags;
+
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(nw->fd, TIOCSSERIAL, &ss)) {
+		perror("TIOCSSERIAL");
+		nw->orig_serial_flags = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* lock memory, and optionally switch to SCHED_FIFO with priority prio
+   (0 = don't change) and bind to cpu (-1 = don't change) */
+int nw_serial_set_realtime(int prio, int cpu)
+{
+	if (mlockall(MCL_CURRENT|MCL_FUTURE)) {
+		perror("mlockall");
+		return 1;
+	}
+
+	if (cpu != -1) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+	}
+
+	if (prio) {
+		struct sched_param sp;
+
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = prio;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp)) {
+			perror("sched_setscheduler");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int nw_serial_show_info(struct nwserial *nw)
 {
 	if (nw_serial_get_info(nw)) {
 		fprintf(stderr, "Error getting info\n");
 		return 1;
 	}
 
-	printf("Version:\t%u.%02u\nSerial:\t\t%u\n",
-	       nw->version>>24, (nw->version>>16)&0xff, nw->serial);
+	printf("Device:\t\t%s\nVersion:\t%u.%02u\nSerial:\t\t%u\n",
+	       nw->device, nw->version>>24, (nw->version>>16)&0xff, nw->serial);
 
 	return 0;
 }
@@ -365,21 +1516,431 @@ int nw_serial_calibrate(struct nwserial *nw, int enable)
 	return 0;
 }
 
-int nw_serial_forward(struct nwserial *nw)
+static void nw_serial_sighandler(int sig)
 {
-	int res;
+	if (sig == SIGUSR1)
+		nw_serial_dump = 1;
+	else if (sig == SIGHUP)
+		nw_serial_reload = 1;
+	else
+		nw_serial_quit = 1;
+}
 
-	nw->ufd = nw_uinput_open();
+struct nwemitter {
+	struct nwserial **nw;
+	int nr;
+	int efd;
+	int quit;
+};
 
-	if (nw->ufd == -1)
-		return 1;
+/* emitter thread, writes reports from the queues to uinput */
+static void *nw_serial_emitter(void *arg)
+{
+	struct nwemitter *e = arg;
+	struct nwreport r;
+	uint64_t val;
+	int i, quit;
 
-	do {
-		res = nw_serial_process(nw);
-	} while (res == 0);
+	for (;;) {
+		/* check before draining, so everything queued before quit
+		   was set still gets written */
+		quit = __atomic_load_n(&e->quit, __ATOMIC_ACQUIRE);
 
-	nw_uinput_close(nw->ufd);
+		for (i=0; i<e->nr; i++) {
+			struct nwserial *nw = e->nw[i];
+
+			if (!nw->q)
+				continue;
+
+			while (nw_queue_get(nw->q, &r))
+				nw_uinput_emit(nw, r.x, r.y, r.button, r.ts);
+
+			nw_uinput_write(nw);
+		}
+
+		if (quit)
+			break;
+
+		if (read(e->efd, &val, sizeof(val)) == -1 && errno != EINTR) {
+			perror("eventfd");
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* stop reading from a disconnected device, but keep the uinput device
+   around so clients don't see it disappear */
+static void nw_serial_disconnect(struct nwserial *nw, int efd)
+{
+	uint64_t now = nw_serial_now();
+
+	epoll_ctl(efd, EPOLL_CTL_DEL, nw->fd, 0);
+	close(nw->fd);
+	nw->fd = -1;
+
+	/* drop partial frame and resync on the new stream */
+	nw->head = nw->tail;
+	nw->filter.valid = 0;
+	nw->lat.last = 0;
+	nw->motion.pending = 0;
+
+	/* don't leave a button stuck down */
+	if (nw->motion.button > 0) {
+		nw->lat.read = now;
+		nw_uinput_action(nw, nw->motion.x, nw->motion.y, 0);
+		nw_uinput_flush(nw);
+		nw->motion.button = 0;
+	}
+
+	nw->reconnect.lost = now;
+	nw->reconnect.delay = NW_SER_RECONNECT_MIN;
+	nw->reconnect.next = now + NW_SER_RECONNECT_MIN * 1000000ULL;
+}
+
+/* try to reopen a disconnected device, returns non-zero and schedules
+   the next attempt on failure */
+static int nw_serial_reconnect(struct nwserial *nw, int efd)
+{
+	struct epoll_event ev;
+	uint64_t now;
+
+	nw->reconnect.attempts++;
+
+	/* not back yet is the normal case, so don't complain about it */
+	if (access(nw->device, R_OK|W_OK) || nw_serial_open(nw))
+		goto err;
+
+	if (nw->orig_serial_flags != -1) {
+		nw->orig_serial_flags = -1;
+		nw_serial_set_low_latency(nw);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = nw;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, nw->fd, &ev)) {
+		perror("epoll_ctl");
+		close(nw->fd);
+		nw->fd = -1;
+		goto err;
+	}
+
+	now = nw_serial_now();
+	nw->reconnect.count++;
+	nw_hist_add(&nw->lat.reconnect, now - nw->reconnect.lost);
+	fprintf(stderr, "%s: reconnected after %.1f ms\n", nw->device,
+		(now - nw->reconnect.lost) / 1e6);
 
 	return 0;
+
+err:
+	nw->reconnect.next = nw_serial_now()
+		+ nw->reconnect.delay * 1000000ULL;
+	nw->reconnect.delay *= 2;
+	if (nw->reconnect.delay > NW_SER_RECONNECT_MAX)
+		nw->reconnect.delay = NW_SER_RECONNECT_MAX;
+
+	return 1;
 }
 
+/* forward events of nr serial devices from a single epoll loop */
+int nw_serial_forward(struct nwserial **nw, int nr)
+{
+	struct epoll_event ev[NW_SER_MAXEVENTS];
+	struct sigaction sa;
+	sigset_t set, orig_set;
+	struct nwemitter emitter;
+	pthread_t thread;
+	uint64_t now, one = 1;
+	int efd, i, n, timeout, threaded = 0, active = 0, ret = 1;
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (efd == -1) {
+		perror("epoll_create");
+		return 1;
+	}
+
+	for (i=0; i<nr; i++) {
+		nw[i]->ufd = nw_uinput_open(nw[i]->device);
+		if (nw[i]->ufd == -1)
+			goto out;
+		nw[i]->last.valid = 0;
+
+		ev[0].events = EPOLLIN;
+		ev[0].data.ptr = nw[i];
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, nw[i]->fd, &ev[0])) {
+			perror("epoll_ctl");
+			nw_uinput_close(nw[i]->ufd);
+			nw[i]->ufd = -1;
+			goto out;
+		}
+
+		active++;
+	}
+
+	ret = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nw_serial_sighandler;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGUSR1, &sa, 0);
+	sigaction(SIGHUP, &sa, 0);
+
+	/* signals only get delivered while waiting in epoll_pwait, so the
+	   flags cannot get set between checking them and going to sleep */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGHUP);
+	sigprocmask(SIG_BLOCK, &set, &orig_set);
+
+	for (i=0; i<nr; i++)
+		if (nw[i]->q)
+			threaded = 1;
+
+	/* signals are blocked, so the thread never handles them */
+	if (threaded) {
+		emitter.nw = nw;
+		emitter.nr = nr;
+		emitter.quit = 0;
+		emitter.efd = eventfd(0, EFD_CLOEXEC);
+		if (emitter.efd == -1) {
+			perror("eventfd");
+			active = 0;
+			threaded = 0;
+			ret = 1;
+		} else {
+			for (i=0; i<nr; i++)
+				if (nw[i]->q)
+					nw[i]->q->efd = emitter.efd;
+
+			if (pthread_create(&thread, 0, nw_serial_emitter,
+					   &emitter)) {
+				fprintf(stderr, "Error creating emitter "
+					"thread\n");
+				close(emitter.efd);
+				active = 0;
+				threaded = 0;
+				ret = 1;
+			}
+		}
+	}
+
+	while (active && !nw_serial_quit) {
+		if (nw_serial_dump) {
+			nw_serial_dump = 0;
+			for (i=0; i<nr; i++)
+				nw_serial_show_stats(nw[i]);
+		}
+
+		/* keep the old transform if the new one is invalid */
+		if (nw_serial_reload) {
+			nw_serial_reload = 0;
+			for (i=0; i<nr; i++) {
+				struct nwserial *ser = nw[i];
+				int64_t m[6];
+
+				if (!ser->xform.file)
+					continue;
+
+				memcpy(m, ser->xform.m, sizeof(m));
+				if (nw_serial_load_transform(ser))
+					memcpy(ser->xform.m, m, sizeof(m));
+			}
+		}
+
+		/* wake up for held back motion reports */
+		timeout = -1;
+		now = nw_serial_now();
+		for (i=0; i<nr; i++) {
+			if (nw[i]->ufd == -1)
+				continue;
+
+			/* disconnected, retry with backoff */
+			if (nw[i]->fd == -1
+			    && (now < nw[i]->reconnect.next
+				|| nw_serial_reconnect(nw[i], efd))) {
+				n = (nw[i]->reconnect.next - now + 999999)
+					/ 1000000;
+				if (timeout == -1 || n < timeout)
+					timeout = n;
+			}
+
+			n = nw_serial_motion_due(nw[i], now);
+			if (n != -1 && (timeout == -1 || n < timeout))
+				timeout = n;
+
+			/* retry reports that didn't fit in the queue */
+			if (nw[i]->q) {
+				if (nw_queue_drain(nw[i]->q))
+					timeout = NW_SER_QUEUE_RETRY;
+				nw_uinput_flush(nw[i]);
+			}
+		}
+
+		n = epoll_pwait(efd, ev, NW_SER_MAXEVENTS, timeout, &orig_set);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_pwait");
+			break;
+		}
+
+		for (i=0; i<n; i++) {
+			struct nwserial *ser = ev[i].data.ptr;
+
+			if (nw_serial_process(ser) == 0)
+				continue;
+
+			if (ser->reconnect.enabled) {
+				fprintf(stderr, "%s: disconnected, reconnecting\n",
+					ser->device);
+				nw_serial_disconnect(ser, efd);
+				continue;
+			}
+
+			/* error or disconnected, stop forwarding this one */
+			fprintf(stderr, "%s: stopped forwarding\n",
+				ser->device);
+			epoll_ctl(efd, EPOLL_CTL_DEL, ser->fd, 0);
+			ser->motion.pending = 0;
+			/* emitter thread may still be using it */
+			if (!ser->q) {
+				nw_uinput_close(ser->ufd);
+				ser->ufd = -1;
+			}
+			active--;
+		}
+	}
+
+	if (threaded) {
+		__atomic_store_n(&emitter.quit, 1, __ATOMIC_RELEASE);
+		if (write(emitter.efd, &one, sizeof(one)) != sizeof(one))
+			perror("eventfd");
+		pthread_join(thread, 0);
+		close(emitter.efd);
+	}
+
+	sigprocmask(SIG_SETMASK, &orig_set, 0);
+
+out:
+	for (i=0; i<nr; i++) {
+		if (nw[i]->ufd != -1) {
+			nw_uinput_close(nw[i]->ufd);
+			nw[i]->ufd = -1;
+		}
+
+		nw_serial_show_stats(nw[i]);
+	}
+
+	close(efd);
+
+	return ret;
+}
+
+/* feed a file recorded with nw_serial_set_record() through the parser
+   and into uinput, either with the original timing or as fast as
+   possible, with motion capped to motion_rate reports/s if not 0 */
+int nw_serial_replay(char *file, int fast, int motion_rate)
+{
+	struct nwserial *nw;
+	FILE *f;
+	unsigned char magic[NW_SER_REC_MAGICLEN], *data = 0;
+	uint32_t hdr[2], len, size = 0;
+	struct timespec ts;
+	uint64_t due, start, elapsed;
+	size_t n;
+	int ret = 1;
+
+	f = fopen(file, "rb");
+	if (!f) {
+		perror(file);
+		return 1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1
+	    || memcmp(magic, NW_SER_REC_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s: not a nwtool recording\n", file);
+		goto err_magic;
+	}
+
+	nw = nw_serial_alloc(file);
+	if (!nw)
+		goto err_magic;
+
+	if (nw_serial_set_motion_rate(nw, motion_rate))
+		goto err_uinput;
+
+	nw->ufd = nw_uinput_open(file);
+	if (nw->ufd == -1)
+		goto err_uinput;
+	nw->last.valid = 0;
+
+	start = due = nw_serial_now();
+
+	while ((n = fread(hdr, 1, sizeof(hdr), f)) == sizeof(hdr)) {
+		len = ntohl(hdr[1]);
+		if (len > size) {
+			unsigned char *p = realloc(data, len);
+
+			if (!p) {
+				perror("malloc");
+				goto err_read;
+			}
+			data = p;
+			size = len;
+		}
+
+		if (fread(data, 1, len, f) != len)
+			break;
+
+		if (!fast) {
+			due += (uint64_t)ntohl(hdr[0]) * 1000;
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, 0) == EINTR)
+				;
+		}
+
+		nw->lat.read = nw_serial_now();
+
+		nw_serial_feed(nw, data, len);
+		nw_serial_account(nw, len);
+		nw_uinput_flush(nw);
+		nw_serial_motion_due(nw, nw->lat.read);
+		nw_serial_log_errors(nw);
+	}
+
+	/* the last motion may still be held back by the rate cap */
+	nw_serial_motion_due(nw, (uint64_t)-1);
+	nw_uinput_flush(nw);
+
+	elapsed = nw_serial_now() - start;
+	fprintf(stderr, "%s: replayed %lu frames in %.3f s (%.0f frames/s)\n",
+		file, nw->stats.frames, elapsed / 1e9,
+		elapsed ? nw->stats.frames * 1e9 / elapsed : 0.0);
+	nw_serial_show_stats(nw);
+
+	/* a partial header or chunk at the end */
+	if (n || ferror(f))
+		fprintf(stderr, "%s: truncated recording\n", file);
+	else
+		ret = 0;
+
+err_read:
+	free(data);
+	nw_uinput_close(nw->ufd);
+
+err_uinput:
+	nw_serial_free(nw);
+
+err_magic:
+	fclose(f);
+
+	return ret;
+}
@@ -17,10 +17,35 @@ struct nwserial *nw_serial_init(char *device);
 
 void nw_serial_deinit(struct nwserial *nw);
 
+int nw_serial_set_bufsize(struct nwserial *nw, int size);
+
+int nw_serial_set_record(struct nwserial *nw, char *file);
+
+int nw_serial_replay(char *file, int fast, int motion_rate);
+
+int nw_serial_set_motion_rate(struct nwserial *nw, int hz);
+
+int nw_serial_set_transform(struct nwserial *nw, char *matrix);
+
+int nw_serial_set_transform_file(struct nwserial *nw, char *file);
+
+int nw_serial_set_filter(struct nwserial *nw, double mincutoff, double beta,
+			 int deadzone);
+
+int nw_serial_set_info_timeout(struct nwserial *nw, int ms, int retries);
+
+int nw_serial_set_reconnect(struct nwserial *nw);
+
+int nw_serial_set_queue(struct nwserial *nw, int size);
+
+int nw_serial_set_low_latency(struct nwserial *nw);
+
+int nw_serial_set_realtime(int prio, int cpu);
+
 int nw_serial_show_info(struct nwserial *nw);
 
 int nw_serial_calibrate(struct nwserial *nw, int enable);
 
-int nw_serial_forward(struct nwserial *nw);
+int nw_serial_forward(struct nwserial **nw, int nr);
 
 #endif /* _NWTOOL_SERIAL_H_ */
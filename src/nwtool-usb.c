@@ -11,7 +11,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef WITH_LIBUSB1
+#include <libusb.h>
+#elif defined(WITH_HIDRAW)
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#else
 #include <hid.h>
+#endif /* WITH_LIBUSB1 */
 #include "nwtool-usb.h"
 
 /*#define NWUSB_VERBOSE 1 */
@@ -30,114 +45,1044 @@
 #define NWUSB_GOT_BUZZERTONE		10
 #define NWUSB_GOT_CALIBRATIONKEY	11
 #define NWUSB_GOT_CALIBRATIONPRESSES	12
+#define NWUSB_GOT_MAX			12
+
+#define NWUSB_GOT_ALL			(((1 << NWUSB_GOT_MAX) - 1) << 1)
+#define NWUSB_GOT_KEY			((1 << NWUSB_GOT_SERIAL) \
+					 | (1 << NWUSB_GOT_FIRMWARE))
+
+#ifndef NWUSB_CACHEFILE
+#define NWUSB_CACHEFILE			"/var/cache/nwtool/usb"
+#endif
+
+/* max reads without a wanted response before giving up */
+#define NWUSB_MAXMISSES			10
+
+#define NWUSB_INTERFACE			1
+#define NWUSB_TIMEOUT			1000 /* ms */
+
+#ifdef WITH_LIBUSB1
+/* interrupt IN transfers kept in flight */
+#define NWUSB_INFLIGHT			4
+/* received packets not read yet, power of 2 */
+#define NWUSB_RXQUEUE			64
+
+#define NWUSB_ERR_NOTFOUND		LIBUSB_ERROR_NOT_FOUND
+#define NWUSB_ERR_ACCESS		LIBUSB_ERROR_ACCESS
+#elif defined(WITH_HIDRAW)
+#ifndef NWUSB_HIDRAW_SYSFS
+#define NWUSB_HIDRAW_SYSFS		"/sys/class/hidraw"
+#endif
+#ifndef NWUSB_HIDRAW_DEV
+#define NWUSB_HIDRAW_DEV		"/dev"
+#endif
+
+#define NWUSB_ERR_NOTFOUND		(-ENOENT)
+#define NWUSB_ERR_ACCESS		(-EACCES)
+#else
+#define NWUSB_ERR_NOTFOUND		HID_RET_DEVICE_NOT_FOUND
+#define NWUSB_ERR_ACCESS		HID_RET_FAIL_DETACH_DRIVER
+#endif /* WITH_LIBUSB1 */
+
+/* responses queued by the mock device */
+#define NWUSB_MOCK_QUEUE		64
+
+#define NWUSB_VID			0x1926
+/* touchscreens handled by one scan */
+#define NWUSB_MAXDEVS			16
+
+struct nwusb;
+
+/* touchscreen found by a transport scan */
+struct nwusb_dev {
+	unsigned short pid;
+	int bus_nr;
+	int dev_nr;
+	char serial[32]; /* USB serial number, empty if unknown */
+#ifdef WITH_LIBUSB1
+	libusb_device *dev; /* referenced until released */
+#elif defined(WITH_HIDRAW)
+	char node[16]; /* hidrawN of the configuration interface */
+#endif /* WITH_LIBUSB1 */
+};
+
+struct nwusb_transport {
+	const char *name;
+	/* find all touchscreens in one pass, returns number found */
+	int (*scan)(struct nwusb_dev *devs, int max);
+	/* drop what scan holds on to, if anything */
+	void (*release)(struct nwusb_dev *devs, int nr);
+	int (*open)(struct nwusb *nw, const struct nwusb_dev *dev);
+	void (*close)(struct nwusb *nw);
+	/* send output report */
+	int (*send)(struct nwusb *nw, void *data, int len);
+	/* wait for input report */
+	int (*recv)(struct nwusb *nw, void *data);
+	int nocache; /* keep its devices out of the settings cache */
+};
 
 struct nwusb {
+	const struct nwusb_transport *t;
+#ifdef WITH_LIBUSB1
+	libusb_device_handle *dev;
+	struct libusb_transfer *in[NWUSB_INFLIGHT];
+	int in_active; /* IN transfers submitted */
+	int out_pending; /* output reports not sent yet */
+	unsigned char rx[NWUSB_RXQUEUE][NWUSB_PACKETSIZE];
+	unsigned int rx_head, rx_tail; /* free running */
+	int rx_waiting; /* cleared when a packet arrives */
+	unsigned long rx_dropped; /* rx queue full */
+#elif defined(WITH_HIDRAW)
+	int fd; /* /dev/hidrawN of the configuration interface */
+#else
 	HIDInterface *hid;
+#endif /* WITH_LIBUSB1 */
+	struct {
+		int latency; /* ms */
+		int reorder; /* chance per response, in % */
+		int drop; /* chance per response, in % */
+		unsigned int seed;
+		unsigned int settings[256];
+		unsigned char queue[NWUSB_MOCK_QUEUE][NWUSB_PACKETSIZE];
+		uint64_t due[NWUSB_MOCK_QUEUE]; /* ns */
+		unsigned int head, tail; /* free running */
+		unsigned long reports, responses, dropped, reordered;
+	} mock;
 	int bus_nr;
 	int dev_nr;
+	FILE *out; /* for the results */
+	int all; /* opened by nw_usb_init_all() */
+	struct {
+		int use; /* serve show_info from cache */
+		int valid; /* key below is known */
+		unsigned int serial;
+		unsigned int firmware;
+	} cache;
 };
 
-static bool nw_usb_match(struct usb_dev_handle const *usbdev,
-			 void *custom, unsigned int len)
+#if defined(WITH_LIBUSB1) || defined(WITH_HIDRAW)
+/* the touchscreens have product id 0x0001 or 0x0003 */
+static int nw_usb_is_touchscreen(unsigned short vid, unsigned short pid)
 {
-	struct nwusb *nw = custom;
-	struct usb_device const *dev;
-	int id;
+	return vid == NWUSB_VID && (pid == 0x0001 || pid == 0x0003);
+}
+#endif
 
-	dev = usb_device((usb_dev_handle*)usbdev);
-	id = strtol(dev->bus->dirname, NULL, 10);
-	if (id != nw->bus_nr)
-		return 0;
+/* with --all the devices run concurrently, so errors say which device
+   they are about and are written in one go */
+static void nw_usb_error(struct nwusb *nw, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int n = 0;
+
+	if (nw && nw->all)
+		n = snprintf(buf, sizeof(buf), "Bus %03d Device %03d: ",
+			     nw->bus_nr, nw->dev_nr);
+
+	va_start(ap, fmt);
+	vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+	va_end(ap);
+
+	fputs(buf, stderr);
+}
+
+#ifdef WITH_LIBUSB1
+/* shared by all devices, so waiting for one of them also completes the
+   transfers of the others */
+static libusb_context *nw_usb_ctx;
+static int nw_usb_users;
+/* with --all the callbacks of a device may run in the thread of another
+   one, so the transfer state of the devices is only touched with this
+   held */
+static pthread_mutex_t nw_usb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void nw_usb_in_done(struct libusb_transfer *t)
+{
+	struct nwusb *nw = t->user_data;
+
+	pthread_mutex_lock(&nw_usb_lock);
+
+	nw->rx_waiting = 0;
+
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (t->status != LIBUSB_TRANSFER_CANCELLED)
+			nw_usb_error(nw, "Error reading report (%d)\n",
+				t->status);
+		nw->in_active--;
+		goto out;
+	}
+
+	if (nw->rx_tail - nw->rx_head < NWUSB_RXQUEUE) {
+		unsigned char *p = nw->rx[nw->rx_tail % NWUSB_RXQUEUE];
 
-	if (nw->dev_nr != -1) {
-		id = strtol(dev->filename, NULL, 10);
-		return id == nw->dev_nr;
+		memcpy(p, t->buffer, t->actual_length);
+		memset(p + t->actual_length, 0,
+		       NWUSB_PACKETSIZE - t->actual_length);
+		nw->rx_tail++;
 	} else {
-		return 1;
+		nw->rx_dropped++;
 	}
+
+	if (libusb_submit_transfer(t))
+		nw->in_active--;
+
+out:
+	pthread_mutex_unlock(&nw_usb_lock);
 }
 
-static int nw_usb_open(unsigned short vid, unsigned short pid, struct nwusb *nw)
+static void nw_usb_out_done(struct libusb_transfer *t)
 {
-	HIDInterfaceMatcher matcher;
+	struct nwusb *nw = t->user_data;
+
+	if (t->status != LIBUSB_TRANSFER_COMPLETED)
+		nw_usb_error(nw, "Error sending report (%d)\n", t->status);
+
+	pthread_mutex_lock(&nw_usb_lock);
+	nw->out_pending--;
+	pthread_mutex_unlock(&nw_usb_lock);
+}
+
+static int nw_usb_libusb_get_cond(const int *cond)
+{
+	int val;
+
+	pthread_mutex_lock(&nw_usb_lock);
+	val = *cond;
+	pthread_mutex_unlock(&nw_usb_lock);
+
+	return val;
+}
+
+/* handle events until *cond is zero or timeout ms have passed */
+static int nw_usb_libusb_wait(const int *cond, int timeout)
+{
+	struct timespec now, end;
+	struct timeval tv;
+	long ms;
 	int ret;
 
-	memset(&matcher, 0, sizeof(matcher));
-	matcher.vendor_id = vid;
-	matcher.product_id = pid;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000;
+
+	while (nw_usb_libusb_get_cond(cond)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (end.tv_sec - now.tv_sec) * 1000
+			+ (end.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			return LIBUSB_ERROR_TIMEOUT;
 
-	if (nw->bus_nr != -1) {
-		matcher.matcher_fn = nw_usb_match;
-		matcher.custom_data = nw;
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+
+		ret = libusb_handle_events_timeout_completed(nw_usb_ctx, &tv,
+							     NULL);
+		if (ret && ret != LIBUSB_ERROR_INTERRUPTED)
+			return ret;
 	}
 
-	ret = hid_init();
+	return 0;
+}
+
+static int nw_usb_libusb_get(void)
+{
+	int ret;
+
+	if (!nw_usb_users) {
+		ret = libusb_init(&nw_usb_ctx);
+		if (ret) {
+			fprintf(stderr, "libusb_init error (%d)\n", ret);
+			return ret;
+		}
+	}
+	nw_usb_users++;
+
+	return 0;
+}
+
+static void nw_usb_libusb_put(void)
+{
+	if (!--nw_usb_users)
+		libusb_exit(nw_usb_ctx);
+}
+
+/* the devices found stay referenced, so they can be opened without
+   getting the device list again */
+static int nw_usb_libusb_scan(struct nwusb_dev *devs, int max)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	ssize_t nr;
+	int i, n = 0, ret;
+
+	ret = nw_usb_libusb_get();
+	if (ret)
+		return ret;
+
+	nr = libusb_get_device_list(nw_usb_ctx, &list);
+	if (nr < 0) {
+		nw_usb_libusb_put();
+		return nr;
+	}
+
+	for (i=0; i<nr && n<max; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc)
+		    || !nw_usb_is_touchscreen(desc.idVendor, desc.idProduct))
+			continue;
+
+		/* the serial number string needs the device opened */
+		memset(&devs[n], 0, sizeof(devs[n]));
+		devs[n].pid = desc.idProduct;
+		devs[n].bus_nr = libusb_get_bus_number(list[i]);
+		devs[n].dev_nr = libusb_get_device_address(list[i]);
+		devs[n].dev = libusb_ref_device(list[i]);
+		n++;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	return n;
+}
+
+static void nw_usb_libusb_release(struct nwusb_dev *devs, int nr)
+{
+	int i;
+
+	for (i=0; i<nr; i++)
+		libusb_unref_device(devs[i].dev);
+
+	nw_usb_libusb_put();
+}
+
+static int nw_usb_libusb_open(struct nwusb *nw, const struct nwusb_dev *dev)
+{
+	int i, ret;
+
+	ret = nw_usb_libusb_get();
+	if (ret)
+		return ret;
+
+	ret = libusb_open(dev->dev, &nw->dev);
+	if (ret)
+		goto err_open;
+
+	libusb_set_auto_detach_kernel_driver(nw->dev, 1);
+	ret = libusb_claim_interface(nw->dev, NWUSB_INTERFACE);
+	if (ret)
+		goto err_claim;
+
+	for (i=0; i<NWUSB_INFLIGHT; i++) {
+		unsigned char *buf;
+
+		nw->in[i] = libusb_alloc_transfer(0);
+		buf = malloc(NWUSB_PACKETSIZE);
+		if (!nw->in[i] || !buf) {
+			fprintf(stderr, "Error allocating transfer\n");
+			libusb_free_transfer(nw->in[i]);
+			nw->in[i] = NULL;
+			free(buf);
+			ret = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+
+		libusb_fill_interrupt_transfer(nw->in[i], nw->dev,
+					       2 | LIBUSB_ENDPOINT_IN, buf,
+					       NWUSB_PACKETSIZE,
+					       nw_usb_in_done, nw, 0);
+		nw->in[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+		ret = libusb_submit_transfer(nw->in[i]);
+		if (ret)
+			break;
+
+		nw->in_active++;
+	}
+
+	if (ret)
+		goto err_submit;
+
+	return 0;
+
+err_submit:
+	for (i=0; i<NWUSB_INFLIGHT; i++)
+		if (nw->in[i])
+			libusb_cancel_transfer(nw->in[i]);
+	nw_usb_libusb_wait(&nw->in_active, NWUSB_TIMEOUT);
+	for (i=0; i<NWUSB_INFLIGHT; i++) {
+		libusb_free_transfer(nw->in[i]);
+		nw->in[i] = NULL;
+	}
+
+	libusb_release_interface(nw->dev, NWUSB_INTERFACE);
+
+err_claim:
+	libusb_close(nw->dev);
+	nw->dev = NULL;
+
+err_open:
+	nw_usb_libusb_put();
+
+	return ret;
+}
+
+static void nw_usb_libusb_close(struct nwusb *nw)
+{
+	int i;
+
+	/* let queued output reports go out */
+	nw_usb_libusb_wait(&nw->out_pending, NWUSB_TIMEOUT);
+
+	for (i=0; i<NWUSB_INFLIGHT; i++)
+		libusb_cancel_transfer(nw->in[i]);
+	nw_usb_libusb_wait(&nw->in_active, NWUSB_TIMEOUT);
+
+	for (i=0; i<NWUSB_INFLIGHT; i++)
+		libusb_free_transfer(nw->in[i]);
+
+	libusb_release_interface(nw->dev, NWUSB_INTERFACE);
+	libusb_close(nw->dev);
+
+	nw_usb_libusb_put();
+}
+
+/* queue an output report on ep0 without waiting for it to be sent */
+static int nw_usb_libusb_send(struct nwusb *nw, void *data, int len)
+{
+	struct libusb_transfer *t;
+	unsigned char *buf;
+	int ret;
+
+	if (len > NWUSB_PACKETSIZE)
+		len = NWUSB_PACKETSIZE;
+
+	t = libusb_alloc_transfer(0);
+	buf = calloc(1, LIBUSB_CONTROL_SETUP_SIZE + NWUSB_PACKETSIZE);
+	if (!t || !buf) {
+		nw_usb_error(nw, "Error allocating transfer\n");
+		libusb_free_transfer(t);
+		free(buf);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* HID SET_REPORT, output report 0 */
+	libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT
+				  | LIBUSB_REQUEST_TYPE_CLASS
+				  | LIBUSB_RECIPIENT_INTERFACE,
+				  0x09, 0x0200, NWUSB_INTERFACE,
+				  NWUSB_PACKETSIZE);
+	memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+	libusb_fill_control_transfer(t, nw->dev, buf, nw_usb_out_done, nw,
+				     NWUSB_TIMEOUT);
+	t->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	/* counted first, as it may complete in another thread right away */
+	pthread_mutex_lock(&nw_usb_lock);
+	nw->out_pending++;
+	pthread_mutex_unlock(&nw_usb_lock);
+
+	ret = libusb_submit_transfer(t);
 	if (ret) {
-		fprintf(stderr, "hid_init error (%d)\n", ret);
+		libusb_free_transfer(t);
+		pthread_mutex_lock(&nw_usb_lock);
+		nw->out_pending--;
+		pthread_mutex_unlock(&nw_usb_lock);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int nw_usb_libusb_recv(struct nwusb *nw, void *data)
+{
+	int ret;
+
+	/* the IN transfers are always running, just wait for one of them */
+	pthread_mutex_lock(&nw_usb_lock);
+	nw->rx_waiting = nw->rx_head == nw->rx_tail && nw->in_active;
+	pthread_mutex_unlock(&nw_usb_lock);
+
+	ret = nw_usb_libusb_wait(&nw->rx_waiting, NWUSB_TIMEOUT);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&nw_usb_lock);
+	if (nw->rx_head != nw->rx_tail) {
+		memcpy(data, nw->rx[nw->rx_head % NWUSB_RXQUEUE],
+		       NWUSB_PACKETSIZE);
+		nw->rx_head++;
+	} else {
+		ret = LIBUSB_ERROR_IO;
+	}
+	pthread_mutex_unlock(&nw_usb_lock);
+
+	return ret;
+}
+
+static const struct nwusb_transport nw_usb_native = {
+	.name	= "libusb-1.0",
+	.scan	= nw_usb_libusb_scan,
+	.release = nw_usb_libusb_release,
+	.open	= nw_usb_libusb_open,
+	.close	= nw_usb_libusb_close,
+	.send	= nw_usb_libusb_send,
+	.recv	= nw_usb_libusb_recv,
+};
+
+#elif defined(WITH_HIDRAW)
+/* read attribute of the hidraw node name, relative to its HID device */
+static int nw_usb_sysfs_read(const char *name, const char *attr, char *buf,
+			     int len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), NWUSB_HIDRAW_SYSFS "/%s/device/%s",
+		 name, attr);
+
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+
+	ret = !fgets(buf, len, f);
+	fclose(f);
+
+	return ret;
+}
+
+static int nw_usb_sysfs_nr(const char *name, const char *attr, int base)
+{
+	char buf[32];
+
+	if (nw_usb_sysfs_read(name, attr, buf, sizeof(buf)))
+		return -1;
+
+	return strtol(buf, NULL, base);
+}
+
+/* is hidraw node name the configuration interface of a touchscreen?
+   Returns its product id or 0 */
+static unsigned short nw_usb_hidraw_match(const char *name)
+{
+	unsigned int bus, v, p;
+	char path[PATH_MAX], line[128];
+	FILE *f;
+	int found = 0;
+
+	snprintf(path, sizeof(path), NWUSB_HIDRAW_SYSFS "/%s/device/uevent",
+		 name);
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	/* HID_ID=<bus>:<vendor>:<product> */
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &v, &p) == 3) {
+			found = (bus == 0x03 && nw_usb_is_touchscreen(v, p));
+			break;
+		}
+
+	fclose(f);
+
+	if (!found)
 		return 0;
+
+	/* the HID device is a child of the USB interface */
+	if (nw_usb_sysfs_nr(name, "../bInterfaceNumber", 16)
+	    != NWUSB_INTERFACE)
+		return 0;
+
+	return p;
+}
+
+/* a single walk of the hidraw nodes, recording the USB device of each
+   touchscreen */
+static int nw_usb_hidraw_scan(struct nwusb_dev *devs, int max)
+{
+	struct dirent *d;
+	DIR *dir;
+	char *nl;
+	int n = 0;
+
+	dir = opendir(NWUSB_HIDRAW_SYSFS);
+	if (!dir)
+		return 0;
+
+	while (n < max && (d = readdir(dir))) {
+		if (strncmp(d->d_name, "hidraw", 6)
+		    || strlen(d->d_name) >= sizeof(devs[n].node))
+			continue;
+
+		memset(&devs[n], 0, sizeof(devs[n]));
+		devs[n].pid = nw_usb_hidraw_match(d->d_name);
+		if (!devs[n].pid)
+			continue;
+
+		strcpy(devs[n].node, d->d_name);
+		devs[n].bus_nr = nw_usb_sysfs_nr(d->d_name, "../../busnum", 10);
+		devs[n].dev_nr = nw_usb_sysfs_nr(d->d_name, "../../devnum", 10);
+		if (!nw_usb_sysfs_read(d->d_name, "../../serial",
+				       devs[n].serial, sizeof(devs[n].serial))) {
+			nl = strchr(devs[n].serial, '\n');
+			if (nl)
+				*nl = 0;
+		}
+		n++;
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+/* the kernel driver stays bound, so the touchscreen keeps working as an
+   input device */
+static int nw_usb_hidraw_open(struct nwusb *nw, const struct nwusb_dev *dev)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), NWUSB_HIDRAW_DEV "/%s", dev->node);
+	nw->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (nw->fd == -1) {
+		if (errno != EACCES)
+			perror(path);
+		return -errno;
 	}
 
+	return 0;
+}
+
+static void nw_usb_hidraw_close(struct nwusb *nw)
+{
+	close(nw->fd);
+}
+
+static int nw_usb_hidraw_send(struct nwusb *nw, void *data, int len)
+{
+	unsigned char buf[NWUSB_PACKETSIZE + 1];
+
+	if (len > NWUSB_PACKETSIZE)
+		len = NWUSB_PACKETSIZE;
+
+	/* reports are not numbered, so report id 0 goes first */
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf + 1, data, len);
+
+	if (write(nw->fd, buf, sizeof(buf)) != sizeof(buf)) {
+		nw_usb_error(nw, "write: %s\n", strerror(errno));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int nw_usb_hidraw_recv(struct nwusb *nw, void *data)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = nw->fd;
+	pfd.events = POLLIN;
+
+	n = poll(&pfd, 1, NWUSB_TIMEOUT);
+	if (n <= 0)
+		return n ? -errno : -ETIMEDOUT;
+
+	n = read(nw->fd, data, NWUSB_PACKETSIZE);
+	if (n <= 0)
+		return n ? -errno : -EIO;
+
+	memset((unsigned char *)data + n, 0, NWUSB_PACKETSIZE - n);
+
+	return 0;
+}
+
+static const struct nwusb_transport nw_usb_native = {
+	.name	= "hidraw",
+	.scan	= nw_usb_hidraw_scan,
+	.open	= nw_usb_hidraw_open,
+	.close	= nw_usb_hidraw_close,
+	.send	= nw_usb_hidraw_send,
+	.recv	= nw_usb_hidraw_recv,
+};
+
+#else
+
+static int nw_usb_hid_users;
+
+static int nw_usb_hid_get(void)
+{
+	int ret;
+
+	if (!nw_usb_hid_users) {
+		ret = hid_init();
+		if (ret) {
+			fprintf(stderr, "hid_init error (%d)\n", ret);
+			return -1;
+		}
+	}
+	nw_usb_hid_users++;
+
+	return 0;
+}
+
+static void nw_usb_hid_put(void)
+{
+	if (!--nw_usb_hid_users)
+		hid_cleanup();
+}
+
+struct nwusb_hid_scan {
+	struct nwusb_dev *devs;
+	int max;
+	int n;
+	unsigned short pid; /* being searched for */
+};
+
+/* bus and device number of a device offered to a matcher */
+static void nw_usb_hid_busdev(struct usb_dev_handle const *usbdev,
+			      int *bus_nr, int *dev_nr)
+{
+	struct usb_device const *dev;
+
+	dev = usb_device((usb_dev_handle*)usbdev);
+	*bus_nr = strtol(dev->bus->dirname, NULL, 10);
+	*dev_nr = strtol(dev->filename, NULL, 10);
+}
+
+/* record every touchscreen offered, but never accept one so libhid
+   goes on with the next */
+static bool nw_usb_hid_list(struct usb_dev_handle const *usbdev,
+			    void *custom, unsigned int len)
+{
+	struct nwusb_hid_scan *s = custom;
+	int i, bus_nr, dev_nr;
+
+	nw_usb_hid_busdev(usbdev, &bus_nr, &dev_nr);
+
+	for (i=0; i<s->n; i++)
+		if (s->devs[i].bus_nr == bus_nr && s->devs[i].dev_nr == dev_nr)
+			return 0;
+
+	if (s->n < s->max) {
+		memset(&s->devs[s->n], 0, sizeof(s->devs[s->n]));
+		s->devs[s->n].pid = s->pid;
+		s->devs[s->n].bus_nr = bus_nr;
+		s->devs[s->n].dev_nr = dev_nr;
+		s->n++;
+	}
+
+	return 0;
+}
+
+/* libhid cannot list devices, so search each product id with a matcher
+   that declines everything */
+static int nw_usb_hid_scan(struct nwusb_dev *devs, int max)
+{
+	static const unsigned short pids[] = { 0x0001, 0x0003 };
+	struct nwusb_hid_scan s = { devs, max, 0, 0 };
+	HIDInterfaceMatcher matcher;
+	HIDInterface *hid;
+	int i;
+
+	if (nw_usb_hid_get())
+		return -1;
+
+	hid = hid_new_HIDInterface();
+	if (!hid) {
+		fprintf(stderr, "new_HID error\n");
+		nw_usb_hid_put();
+		return -1;
+	}
+
+	memset(&matcher, 0, sizeof(matcher));
+	matcher.vendor_id = NWUSB_VID;
+	matcher.matcher_fn = nw_usb_hid_list;
+	matcher.custom_data = &s;
+
+	for (i=0; i<sizeof(pids)/sizeof(pids[0]); i++) {
+		s.pid = matcher.product_id = pids[i];
+		if (!hid_force_open(hid, NWUSB_INTERFACE, &matcher, 3))
+			hid_close(hid);
+	}
+
+	hid_delete_HIDInterface(&hid);
+	nw_usb_hid_put();
+
+	return s.n;
+}
+
+/* only accept the scanned touchscreen */
+static bool nw_usb_hid_match(struct usb_dev_handle const *usbdev,
+			 void *custom, unsigned int len)
+{
+	const struct nwusb_dev *dev = custom;
+	int bus_nr, dev_nr;
+
+	nw_usb_hid_busdev(usbdev, &bus_nr, &dev_nr);
+
+	return bus_nr == dev->bus_nr && dev_nr == dev->dev_nr;
+}
+
+static int nw_usb_hid_open(struct nwusb *nw, const struct nwusb_dev *dev)
+{
+	HIDInterfaceMatcher matcher;
+	int ret;
+
+	/* libhid can only open by matcher, so match the scanned device */
+	memset(&matcher, 0, sizeof(matcher));
+	matcher.vendor_id = NWUSB_VID;
+	matcher.product_id = dev->pid;
+	matcher.matcher_fn = nw_usb_hid_match;
+	matcher.custom_data = (void *)dev;
+
+	ret = nw_usb_hid_get();
+	if (ret)
+		return ret;
+
 	nw->hid = hid_new_HIDInterface();
 	if (!nw->hid) {
 		fprintf(stderr, "new_HID error\n");
+		ret = -1;
 		goto err_new_intf;
 	}
 
-	/* todo: somehow parse HID description to figure out correct interface
-	   number instead */
-	ret = hid_force_open(nw->hid, 1, &matcher, 3);
-	if (ret)
-		goto err_force_open;
+	/* todo: somehow parse HID description to figure out correct interface
+	   number instead */
+	ret = hid_force_open(nw->hid, NWUSB_INTERFACE, &matcher, 3);
+	if (ret)
+		goto err_force_open;
+
+	return 0;
+
+err_force_open:
+	hid_delete_HIDInterface(&nw->hid);
+
+err_new_intf:
+	nw_usb_hid_put();
+	nw->hid = NULL;
+
+	return ret;
+}
+
+static void nw_usb_hid_close(struct nwusb *nw)
+{
+	hid_close(nw->hid);
+	hid_delete_HIDInterface(&nw->hid);
+	nw_usb_hid_put();
+}
+
+static int nw_usb_hid_send(struct nwusb *nw, void *data, int len)
+{
+	const int PATH[] = { 0xffa00001, 0xffa00001 };
+	char buf[NWUSB_PACKETSIZE];
+
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+
+	memcpy(buf, data, len);
+
+	/* output HID report to ep0 */
+	return hid_set_output_report(nw->hid, PATH,
+				     sizeof(PATH)/sizeof(PATH[0]),
+				     buf, sizeof(buf));
+}
+
+static int nw_usb_hid_recv(struct nwusb *nw, void *data)
+{
+	return hid_interrupt_read(nw->hid, 2 | USB_ENDPOINT_IN, data,
+				  NWUSB_PACKETSIZE, NWUSB_TIMEOUT);
+}
+
+static const struct nwusb_transport nw_usb_native = {
+	.name	= "libhid",
+	.scan	= nw_usb_hid_scan,
+	.open	= nw_usb_hid_open,
+	.close	= nw_usb_hid_close,
+	.send	= nw_usb_hid_send,
+	.recv	= nw_usb_hid_recv,
+};
+
+#endif /* WITH_LIBUSB1 */
+
+static uint64_t nw_usb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* in-process emulation of the 'C' command set, for testing without a
+   touchscreen */
+static int nw_usb_mock_scan(struct nwusb_dev *devs, int max)
+{
+	memset(devs, 0, sizeof(*devs));
+	devs->pid = 0x0001;
+	strcpy(devs->serial, "mock");
+
+	return 1;
+}
+
+static int nw_usb_mock_open(struct nwusb *nw, const struct nwusb_dev *dev)
+{
+	static const unsigned int defaults[256] = {
+		[0x10] = 0x0002, /* model */
+		[0x11] = 0x0128, /* firmware */
+		[0x12] = 12345, /* serial */
+		[0x20] = 0x03, /* hw caps */
+		[0x30] = 50, [0x31] = 30, [0x32] = 0x0f, [0x33] = 100,
+		[0x34] = 10, [0x35] = 20, [0x40] = 0, [0x41] = 3,
+	};
+
+	memcpy(nw->mock.settings, defaults, sizeof(defaults));
+	nw->mock.head = nw->mock.tail = 0;
+	nw->mock.seed = 1;
+
+	return 0;
+}
+
+static void nw_usb_mock_close(struct nwusb *nw)
+{
+	fprintf(stderr, "Mock: %lu reports, %lu responses (%lu dropped, "
+		"%lu reordered)\n", nw->mock.reports, nw->mock.responses,
+		nw->mock.dropped, nw->mock.reordered);
+}
+
+static int nw_usb_mock_send(struct nwusb *nw, void *data, int len)
+{
+	unsigned char *buf = data, *r;
+	unsigned int val;
+	int i;
+
+	nw->mock.reports++;
+
+	if (len < 3 || buf[0] != 'C')
+		return 0;
+
+	/* set */
+	if (buf[1] > 1) {
+		if (len >= 2 + buf[1])
+			nw->mock.settings[buf[2]] = buf[1] == 3
+				? (buf[3] << 8) | buf[4] : buf[3];
+		return 0;
+	}
+
+	if (rand_r(&nw->mock.seed) % 100 < nw->mock.drop) {
+		nw->mock.dropped++;
+		return 0;
+	}
+
+	if (nw->mock.tail - nw->mock.head == NWUSB_MOCK_QUEUE)
+		return 0;
+
+	i = nw->mock.tail++ % NWUSB_MOCK_QUEUE;
+	nw->mock.due[i] = nw_usb_now()
+		+ nw->mock.latency * 1000000ULL;
+
+	r = nw->mock.queue[i];
+	memset(r, 0, NWUSB_PACKETSIZE);
+	r[0] = 'C';
+	r[1] = 5;
+	r[2] = buf[2];
+
+	val = nw->mock.settings[buf[2]];
+	switch (buf[2]) {
+	case 0x12:
+		r[3] = val >> 24;
+		r[4] = val >> 16;
+		r[5] = val >> 8;
+		r[6] = val;
+		break;
+
+	case 0x10:
+	case 0x11:
+	case 0x33:
+		r[3] = val >> 8;
+		r[4] = val;
+		break;
+
+	default:
+		r[3] = val;
+		break;
+	}
+
+	/* swap with the previous response, keeping the due times */
+	if (nw->mock.tail - nw->mock.head >= 2
+	    && rand_r(&nw->mock.seed) % 100 < nw->mock.reorder) {
+		unsigned char tmp[NWUSB_PACKETSIZE];
+		int prev = (nw->mock.tail - 2) % NWUSB_MOCK_QUEUE;
+
+		memcpy(tmp, r, NWUSB_PACKETSIZE);
+		memcpy(r, nw->mock.queue[prev], NWUSB_PACKETSIZE);
+		memcpy(nw->mock.queue[prev], tmp, NWUSB_PACKETSIZE);
+		nw->mock.reordered++;
+	}
 
 	return 0;
+}
 
-err_force_open:
-	hid_delete_HIDInterface(&nw->hid);
+static int nw_usb_mock_recv(struct nwusb *nw, void *data)
+{
+	uint64_t now, due;
+	struct timespec ts;
 
-err_new_intf:
-	hid_cleanup();
-	nw->hid = NULL;
+	now = nw_usb_now();
+	if (nw->mock.head == nw->mock.tail)
+		due = now + NWUSB_TIMEOUT * 1000000ULL;
+	else
+		due = nw->mock.due[nw->mock.head % NWUSB_MOCK_QUEUE];
+
+	if (due > now) {
+		if (due - now > NWUSB_TIMEOUT * 1000000ULL)
+			due = now + NWUSB_TIMEOUT * 1000000ULL;
+		ts.tv_sec = (due - now) / 1000000000;
+		ts.tv_nsec = (due - now) % 1000000000;
+		nanosleep(&ts, 0);
+	}
 
-	return ret;
-}
+	if (nw->mock.head == nw->mock.tail)
+		return -ETIMEDOUT;
 
-static void nw_usb_close(HIDInterface *hid)
-{
-	hid_close(hid);
-	hid_delete_HIDInterface(&hid);
-	hid_cleanup();
+	memcpy(data, nw->mock.queue[nw->mock.head++ % NWUSB_MOCK_QUEUE],
+	       NWUSB_PACKETSIZE);
+	nw->mock.responses++;
+
+	return 0;
 }
 
+static const struct nwusb_transport nw_usb_mock = {
+	.name	= "mock",
+	.scan	= nw_usb_mock_scan,
+	.open	= nw_usb_mock_open,
+	.close	= nw_usb_mock_close,
+	.send	= nw_usb_mock_send,
+	.recv	= nw_usb_mock_recv,
+	.nocache = 1,
+};
+
 static int nw_usb_send(struct nwusb *nw, void *data, int len)
 {
-	const int PATH[] = { 0xffa00001, 0xffa00001 };
-	char buf[NWUSB_PACKETSIZE];
-
-	if (len > sizeof(buf))
-		len = sizeof(buf);
-
-	memcpy(buf, data, len);
-
 #ifdef NWUSB_VERBOSE
 	{
 		int i;
 		printf("sending ");
-		for (i=0; i<6; i++)
-			printf("%02x ", (unsigned char)buf[i]);
+		for (i=0; i<6 && i<len; i++)
+			printf("%02x ", ((unsigned char *)data)[i]);
 		printf("\n");
 	}
 #endif /* NWUSB_VERBOSE */
 
-	/* output HID report to ep0 */
-	return hid_set_output_report(nw->hid, PATH,
-				     sizeof(PATH)/sizeof(PATH[0]),
-				     buf, sizeof(buf));
+	return nw->t->send(nw, data, len);
 }
 
 static int nw_usb_recv(struct nwusb *nw, void *data)
 {
-	return hid_interrupt_read(nw->hid, 2 | USB_ENDPOINT_IN, data,
-				  NWUSB_PACKETSIZE, 1000);
+	return nw->t->recv(nw, data);
 }
 
 static int nw_usb_hard_reset(struct nwusb *nw)
@@ -168,7 +1113,7 @@ static int nw_usb_parse(struct nwusb *nw, unsigned char *buf,
 		return 0;
 
 	if (buf[0] != 'C') {
-		fprintf(stderr, "Unknown packet type (0x%02x)\n", buf[0]);
+		nw_usb_error(nw, "Unknown packet type (0x%02x)\n", buf[0]);
 		return 0;
 	}
 
@@ -177,7 +1122,7 @@ static int nw_usb_parse(struct nwusb *nw, unsigned char *buf,
 	case 0x11: got = NWUSB_GOT_FIRMWARE; *result = data16; break;
 	case 0x12: got = NWUSB_GOT_SERIAL; *result = data32; break;
 	case 0x20: got = NWUSB_GOT_HWCAPS; *result = buf[3]; break;
-	case 0x21: break; /* calibration mode */
+	case 0x21: got = 0; break; /* calibration mode */
 	case 0x30: got = NWUSB_GOT_RIGHTCLICKDELAY; *result = buf[3]; break;
 	case 0x31: got = NWUSB_GOT_DOUBLECLICKTIME; *result = buf[3]; break;
 	case 0x32: got = NWUSB_GOT_REPORTMODE; *result = buf[3]; break;
@@ -188,287 +1133,644 @@ static int nw_usb_parse(struct nwusb *nw, unsigned char *buf,
 	case 0x41: got = NWUSB_GOT_CALIBRATIONPRESSES; *result = buf[3]; break;
 
 	default:
-		fprintf(stderr, "unknown 'C' packet (0x%02x)\n", buf[2]);
+		nw_usb_error(nw, "unknown 'C' packet (0x%02x)\n", buf[2]);
 		got = 0;
 	}
 
 	return got;
 }
 
-static int nw_usb_poll(struct nwusb *nw, int msg, unsigned int *result)
+/* 'C' query codes of the settings, in nw_usb_show_info() order */
+static const struct {
+	unsigned char code;
+	int got;
+	const char *name; /* in profiles, NULL if read only */
+	int unit; /* of the profile value in device units */
+	int len; /* of the value in bytes */
+} nw_usb_queries[] = {
+	{ 0x11, NWUSB_GOT_FIRMWARE },
+	{ 0x12, NWUSB_GOT_SERIAL },
+	{ 0x10, NWUSB_GOT_MODEL },
+	{ 0x20, NWUSB_GOT_HWCAPS },
+	{ 0x30, NWUSB_GOT_RIGHTCLICKDELAY,	"rightclick",		10, 1 },
+	{ 0x31, NWUSB_GOT_DOUBLECLICKTIME,	"doubleclick",		10, 1 },
+	{ 0x32, NWUSB_GOT_REPORTMODE,		"report-mode",		1, 1 },
+	{ 0x33, NWUSB_GOT_DRAGTHRESHOLD,	"drag-threshold",	1, 2 },
+	{ 0x34, NWUSB_GOT_BUZZERTIME,		"buzzer-time",		10, 1 },
+	{ 0x35, NWUSB_GOT_BUZZERTONE,		"buzzer-tone",		1, 1 },
+	{ 0x40, NWUSB_GOT_CALIBRATIONKEY,	"calibration-key",	1, 1 },
+	{ 0x41, NWUSB_GOT_CALIBRATIONPRESSES,	"calibration-presses",	1, 1 },
+};
+
+#define NWUSB_NR_QUERIES	(sizeof(nw_usb_queries)/sizeof(nw_usb_queries[0]))
+
+/* send the queries for the bitmask of NWUSB_GOT_* values in wanted back
+   to back, and collect the responses in any order into result[] indexed
+   by NWUSB_GOT_*. Returns bitmask of results received */
+static unsigned int nw_usb_query(struct nwusb *nw, unsigned int wanted,
+				 unsigned int *result)
 {
 	unsigned char buf[NWUSB_PACKETSIZE];
-	int i;
+	unsigned int val, sent = 0, got = 0;
+	int i, n, misses = 0;
+
+	for (i=0; i<NWUSB_NR_QUERIES; i++) {
+		unsigned char query[] = { 'C', 1, nw_usb_queries[i].code };
+
+		if (!(wanted & (1 << nw_usb_queries[i].got)))
+			continue;
+
+		if (nw_usb_send(nw, query, sizeof(query)))
+			break;
+
+		sent |= 1 << nw_usb_queries[i].got;
+	}
 
-	for (i=0; i<10; i++) {
-		if (!nw_usb_recv(nw, buf))
-			if (nw_usb_parse(nw, buf, result) == msg)
-				return 1;
+	while (got != sent && misses < NWUSB_MAXMISSES) {
+		if (nw_usb_recv(nw, buf)) {
+			misses++;
+			continue;
+		}
+
+		n = nw_usb_parse(nw, buf, &val);
+		if (!n || !(sent & (1 << n))) {
+			misses++;
+			continue;
+		}
+
+		result[n] = val;
+		got |= 1 << n;
 	}
 
+	return got;
+}
+
+/* the settings cache has a line per device with the values of all
+   settings in NWUSB_GOT_* order, keyed by serial number and firmware.
+   With --all several devices may update it at once */
+static pthread_mutex_t nw_usb_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nw_usb_cache_parse(const char *line, unsigned int *val)
+{
+	return sscanf(line, "%u %u %u %u %u %u %u %u %u %u %u %u",
+		      &val[1], &val[2], &val[3], &val[4], &val[5], &val[6],
+		      &val[7], &val[8], &val[9], &val[10], &val[11],
+		      &val[12]) == NWUSB_GOT_MAX;
+}
+
+/* read serial number and firmware of the device, if not known yet */
+static int nw_usb_cache_key(struct nwusb *nw)
+{
+	unsigned int val[NWUSB_GOT_MAX + 1];
+
+	if (nw->t->nocache)
+		return 1;
+
+	if (nw->cache.valid)
+		return 0;
+
+	if (nw_usb_query(nw, NWUSB_GOT_KEY, val) != NWUSB_GOT_KEY)
+		return 1;
+
+	nw->cache.serial = val[NWUSB_GOT_SERIAL];
+	nw->cache.firmware = val[NWUSB_GOT_FIRMWARE];
+	nw->cache.valid = 1;
+
 	return 0;
 }
 
-static int nw_usb_get_model(struct nwusb *nw, unsigned int *result)
+/* look up the device in the cache, returns bitmask of values in val */
+static unsigned int nw_usb_cache_load(struct nwusb *nw, unsigned int *val)
 {
-	unsigned char buf[] = { 'C', 1, 0x10 };
-	int ret;
+	unsigned int tmp[NWUSB_GOT_MAX + 1], got = NWUSB_GOT_KEY;
+	char line[256];
+	FILE *f;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	if (nw_usb_cache_key(nw))
+		return 0;
+
+	val[NWUSB_GOT_SERIAL] = nw->cache.serial;
+	val[NWUSB_GOT_FIRMWARE] = nw->cache.firmware;
+
+	pthread_mutex_lock(&nw_usb_cache_lock);
 
-	return nw_usb_poll(nw, NWUSB_GOT_MODEL, result);
+	f = fopen(NWUSB_CACHEFILE, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!nw_usb_cache_parse(line, tmp)
+			    || tmp[NWUSB_GOT_SERIAL] != nw->cache.serial
+			    || tmp[NWUSB_GOT_FIRMWARE] != nw->cache.firmware)
+				continue;
+
+			memcpy(val, tmp, sizeof(tmp));
+			got = NWUSB_GOT_ALL;
+			break;
+		}
+
+		fclose(f);
+	}
+
+	pthread_mutex_unlock(&nw_usb_cache_lock);
+
+	return got;
 }
 
-static int nw_usb_get_firmware(struct nwusb *nw, unsigned int *result)
+/* replace the entry of the device with val, or just remove it if val is
+   NULL. The cache is only an optimization, so a missing cache directory
+   isn't an error */
+static void nw_usb_cache_write(struct nwusb *nw, const unsigned int *val)
 {
-	unsigned char buf[] = { 'C', 1, 0x11 };
-	int ret;
+	unsigned int tmp[NWUSB_GOT_MAX + 1];
+	char line[256], name[] = NWUSB_CACHEFILE ".XXXXXX";
+	FILE *in, *out;
+	int fd, i;
+
+	fd = mkstemp(name);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			nw_usb_error(nw, "%s: %s\n", name, strerror(errno));
+		return;
+	}
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	out = fdopen(fd, "w");
+	if (!out) {
+		nw_usb_error(nw, "fdopen: %s\n", strerror(errno));
+		close(fd);
+		unlink(name);
+		return;
+	}
+
+	in = fopen(NWUSB_CACHEFILE, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (!nw_usb_cache_parse(line, tmp)
+			    || (tmp[NWUSB_GOT_SERIAL] == nw->cache.serial
+				&& tmp[NWUSB_GOT_FIRMWARE]
+				== nw->cache.firmware))
+				continue;
+
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	if (val) {
+		for (i=1; i<=NWUSB_GOT_MAX; i++)
+			fprintf(out, "%u%c", val[i],
+				i == NWUSB_GOT_MAX ? '\n' : ' ');
+	}
+
+	if (fclose(out) || rename(name, NWUSB_CACHEFILE)) {
+		nw_usb_error(nw, NWUSB_CACHEFILE ": %s\n", strerror(errno));
+		unlink(name);
+	}
+}
 
-	return nw_usb_poll(nw, NWUSB_GOT_FIRMWARE, result);
+static void nw_usb_cache_store(struct nwusb *nw, const unsigned int *val)
+{
+	pthread_mutex_lock(&nw_usb_cache_lock);
+	nw_usb_cache_write(nw, val);
+	pthread_mutex_unlock(&nw_usb_cache_lock);
 }
 
-static int nw_usb_get_serial(struct nwusb *nw, unsigned int *result)
+/* a setting was written, update the cached value. If the write failed
+   the entry is removed, and if the device cannot be identified the
+   whole cache. Costs a serial/firmware query per device and a rewrite
+   of the cache file, but only once the cache is in use */
+static void nw_usb_cache_update(struct nwusb *nw, int got, unsigned int value,
+				int ret)
 {
-	unsigned char buf[] = { 'C', 1, 0x12 };
-	int ret;
+	unsigned int val[NWUSB_GOT_MAX + 1];
+
+	/* nothing cached, so no need to identify the device */
+	if (nw->t->nocache || access(NWUSB_CACHEFILE, F_OK))
+		return;
+
+	if (nw_usb_cache_key(nw)) {
+		pthread_mutex_lock(&nw_usb_cache_lock);
+		if (unlink(NWUSB_CACHEFILE) && errno != ENOENT)
+			nw_usb_error(nw, NWUSB_CACHEFILE ": %s\n",
+				     strerror(errno));
+		pthread_mutex_unlock(&nw_usb_cache_lock);
+		return;
+	}
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	if (ret) {
+		nw_usb_cache_store(nw, 0);
+		return;
+	}
+
+	if (nw_usb_cache_load(nw, val) != NWUSB_GOT_ALL)
+		return;
 
-	return nw_usb_poll(nw, NWUSB_GOT_SERIAL, result);
+	val[got] = value;
+	nw_usb_cache_store(nw, val);
 }
 
-static int nw_usb_get_hw_caps(struct nwusb *nw, unsigned int *result)
+/* send a setting and keep the cache up to date */
+static int nw_usb_set(struct nwusb *nw, unsigned char *buf, int len,
+		      int got, unsigned int value)
 {
-	unsigned char buf[] = { 'C', 1, 0x20 };
 	int ret;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	ret = nw_usb_send(nw, buf, len);
+	nw_usb_cache_update(nw, got, value, ret);
 
-	return nw_usb_poll(nw, NWUSB_GOT_HWCAPS, result);
+	return ret;
 }
 
-static int nw_usb_get_rightclick_delay(struct nwusb *nw, unsigned int *result)
+static struct nwusb *nw_usb_alloc(const struct nwusb_transport *t,
+				  int bus_nr, int dev_nr)
 {
-	unsigned char buf[] = { 'C', 1, 0x30 };
-	int ret;
+	struct nwusb *nw;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	nw = calloc(1, sizeof(struct nwusb));
+	if (!nw) {
+		perror("malloc");
+		return 0;
+	}
+
+	nw->t = t;
+	nw->bus_nr = bus_nr;
+	nw->dev_nr = dev_nr;
+	nw->out = stdout;
 
-	return nw_usb_poll(nw, NWUSB_GOT_RIGHTCLICKDELAY, result);
+	return nw;
 }
 
-static int nw_usb_get_doubleclick_time(struct nwusb *nw, unsigned int *result)
+static void nw_usb_open_error(int ret)
 {
-	unsigned char buf[] = { 'C', 1, 0x31 };
-	int ret;
+	switch (ret) {
+	case NWUSB_ERR_NOTFOUND:
+		fprintf(stderr, "Error: No touchscreen detected\n");
+		break;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	case NWUSB_ERR_ACCESS:
+		fprintf(stderr, "Error accessing touchscreen, are you root?\n");
+		break;
 
-	return nw_usb_poll(nw, NWUSB_GOT_DOUBLECLICKTIME, result);
+	default:
+		fprintf(stderr, "Error opening device (%d)\n", ret);
+		break;
+	}
 }
 
-static int nw_usb_get_report_mode(struct nwusb *nw, unsigned int *result)
+static int nw_usb_dev_cmp(const void *a, const void *b)
 {
-	unsigned char buf[] = { 'C', 1, 0x32 };
-	int ret;
+	const struct nwusb_dev *da = a, *db = b;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	if (da->bus_nr != db->bus_nr)
+		return da->bus_nr - db->bus_nr;
 
-	return nw_usb_poll(nw, NWUSB_GOT_REPORTMODE, result);
+	return da->dev_nr - db->dev_nr;
 }
 
-static int nw_usb_get_drag_threshold(struct nwusb *nw, unsigned int *result)
+/* scan for touchscreens, in bus/dev order */
+static int nw_usb_scan(const struct nwusb_transport *t,
+		       struct nwusb_dev *devs)
 {
-	unsigned char buf[] = { 'C', 1, 0x33 };
-	int ret;
+	int nr;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	nr = t->scan(devs, NWUSB_MAXDEVS);
+	if (nr > 1)
+		qsort(devs, nr, sizeof(*devs), nw_usb_dev_cmp);
 
-	return nw_usb_poll(nw, NWUSB_GOT_DRAGTHRESHOLD, result);
+	return nr;
 }
 
-static int nw_usb_get_buzzer_time(struct nwusb *nw, unsigned int *result)
+/* index of the scanned touchscreen on the wanted bus/dev, preferring
+   product id 0x0001, or -1 */
+static int nw_usb_select(struct nwusb *nw, const struct nwusb_dev *devs,
+			 int nr)
 {
-	unsigned char buf[] = { 'C', 1, 0x34 };
-	int ret;
+	int i, found = -1;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	for (i=0; i<nr; i++) {
+		if (nw->bus_nr != -1 && devs[i].bus_nr != nw->bus_nr)
+			continue;
+
+		if (nw->dev_nr != -1 && devs[i].dev_nr != nw->dev_nr)
+			continue;
 
-	return nw_usb_poll(nw, NWUSB_GOT_BUZZERTIME, result);
+		if (devs[i].pid == 0x0001)
+			return i;
+
+		if (found == -1)
+			found = i;
+	}
+
+	return found;
 }
 
-static int nw_usb_get_buzzer_tone(struct nwusb *nw, unsigned int *result)
+/* open the device of an allocated nwusb, freeing it on failure */
+static struct nwusb *nw_usb_connect(struct nwusb *nw)
 {
-	unsigned char buf[] = { 'C', 1, 0x35 };
-	int ret;
+	struct nwusb_dev devs[NWUSB_MAXDEVS];
+	int i, nr, ret;
+
+	nr = nw_usb_scan(nw->t, devs);
+	if (nr >= 0) {
+		i = nw_usb_select(nw, devs, nr);
+		ret = i == -1 ? NWUSB_ERR_NOTFOUND : nw->t->open(nw, &devs[i]);
+		if (nw->t->release)
+			nw->t->release(devs, nr);
+	} else {
+		ret = nr;
+	}
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	if (ret) {
+		nw_usb_open_error(ret);
+		free(nw);
+		return 0;
+	}
 
-	return nw_usb_poll(nw, NWUSB_GOT_BUZZERTONE, result);
+	return nw;
 }
 
-static int nw_usb_get_calibration_key(struct nwusb *nw, unsigned int *result)
+struct nwusb *nw_usb_init(int bus_nr, int dev_nr)
 {
-	unsigned char buf[] = { 'C', 1, 0x40 };
-	int ret;
+	struct nwusb *nw;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	nw = nw_usb_alloc(&nw_usb_native, bus_nr, dev_nr);
+	if (!nw)
+		return 0;
 
-	return nw_usb_poll(nw, NWUSB_GOT_CALIBRATIONKEY, result);
+	return nw_usb_connect(nw);
 }
 
-static int nw_usb_get_calibration_presses(struct nwusb *nw,
-					  unsigned int *result)
+/* use the mock device instead, with responses delayed by latency ms and
+   reorder/drop % chance of being swapped with the previous or lost */
+struct nwusb *nw_usb_init_mock(int latency, int reorder, int drop)
 {
-	unsigned char buf[] = { 'C', 1, 0x41 };
-	int ret;
+	struct nwusb *nw;
 
-	ret = nw_usb_send(nw, buf, sizeof(buf));
-	if (ret)
-		return ret;
+	nw = nw_usb_alloc(&nw_usb_mock, -1, -1);
+	if (!nw)
+		return 0;
 
-	return nw_usb_poll(nw, NWUSB_GOT_CALIBRATIONPRESSES, result);
+	nw->mock.latency = latency;
+	nw->mock.reorder = reorder;
+	nw->mock.drop = drop;
+
+	return nw_usb_connect(nw);
 }
 
-struct nwusb *nw_usb_init(int bus_nr, int dev_nr)
+/* open all touchscreens found, returns number opened */
+int nw_usb_init_all(struct nwusb **nw, int max)
 {
+	const struct nwusb_transport *t = &nw_usb_native;
+	struct nwusb_dev devs[NWUSB_MAXDEVS];
+	int i, nr, ret, n = 0;
+
+	nr = nw_usb_scan(t, devs);
+	if (nr < 0) {
+		nw_usb_open_error(nr);
+		return 0;
+	}
+
+	if (!nr)
+		nw_usb_open_error(NWUSB_ERR_NOTFOUND);
+
+	for (i=0; i<nr && n<max; i++) {
+		nw[n] = nw_usb_alloc(t, devs[i].bus_nr, devs[i].dev_nr);
+		if (!nw[n])
+			break;
+
+		nw[n]->all = 1;
+		ret = t->open(nw[n], &devs[i]);
+		if (ret) {
+			fprintf(stderr, "Bus %03d Device %03d: ",
+				devs[i].bus_nr, devs[i].dev_nr);
+			nw_usb_open_error(ret);
+			free(nw[n]);
+			continue;
+		}
+
+		n++;
+	}
+
+	if (t->release)
+		t->release(devs, nr);
+
+	return n;
+}
+
+struct nwusb_worker {
 	struct nwusb *nw;
+	int (*fn)(struct nwusb *nw, void *data);
+	void *data;
+	pthread_t thread;
+	int started;
 	int ret;
+	uint64_t ns;
+	char *buf; /* what fn printed */
+	size_t len;
+};
 
-	nw = calloc(1, sizeof(struct nwusb));
-	if (!nw) {
+static void *nw_usb_worker(void *arg)
+{
+	struct nwusb_worker *w = arg;
+	uint64_t start = nw_usb_now();
+
+	w->ret = w->fn(w->nw, w->data);
+	w->ns = nw_usb_now() - start;
+
+	return 0;
+}
+
+/* run fn on all touchscreens at once, in a thread each. What it prints
+   is buffered and shown per touchscreen when all of them are done.
+   Returns number of touchscreens fn failed on */
+int nw_usb_run_all(struct nwusb **nw, int nr,
+		   int (*fn)(struct nwusb *nw, void *data), void *data)
+{
+	struct nwusb_worker *w;
+	uint64_t start;
+	int i, failed = 0;
+
+	w = calloc(nr, sizeof(*w));
+	if (!w) {
 		perror("malloc");
-		return 0;
+		return nr;
 	}
 
-	nw->bus_nr = bus_nr;
-	nw->dev_nr = dev_nr;
+	start = nw_usb_now();
+
+	for (i=0; i<nr; i++) {
+		w[i].nw = nw[i];
+		w[i].fn = fn;
+		w[i].data = data;
 
-	ret = nw_usb_open(0x1926, 0x0001, nw);
-	if (ret == HID_RET_DEVICE_NOT_FOUND) {
-		ret = nw_usb_open(0x1926, 0x0003, nw);
+		nw[i]->out = open_memstream(&w[i].buf, &w[i].len);
+		if (!nw[i]->out) {
+			perror("open_memstream");
+			nw[i]->out = stdout;
+		}
+
+		w[i].started = !pthread_create(&w[i].thread, 0, nw_usb_worker,
+						&w[i]);
+		if (!w[i].started)
+			nw_usb_worker(&w[i]);
 	}
 
-	switch (ret) {
-	case 0:
-		break;
+	for (i=0; i<nr; i++) {
+		if (w[i].started)
+			pthread_join(w[i].thread, 0);
 
-	case HID_RET_DEVICE_NOT_FOUND:
-		fprintf(stderr, "Error: No touchscreen detected\n");
-		break;
+		if (nw[i]->out != stdout) {
+			fclose(nw[i]->out);
+			nw[i]->out = stdout;
+		}
 
-	case HID_RET_FAIL_DETACH_DRIVER:
-		fprintf(stderr, "Error accessing touchscreen, are you root?\n");
-		break;
+		printf("Bus %03d Device %03d: %s (%llu ms)\n", nw[i]->bus_nr,
+		       nw[i]->dev_nr, w[i].ret ? "failed" : "done",
+		       (unsigned long long)w[i].ns / 1000000);
+		if (w[i].buf)
+			fwrite(w[i].buf, 1, w[i].len, stdout);
+		free(w[i].buf);
 
-	default:
-		fprintf(stderr, "Error opening device (%d)\n", ret);
-		break;
+		if (w[i].ret)
+			failed++;
 	}
 
-	if (ret) {
-		free(nw);
-		return 0;
+	printf("%d of %d touchscreens done in %llu ms\n", nr - failed, nr,
+	       (unsigned long long)(nw_usb_now() - start) / 1000000);
+
+	free(w);
+
+	return failed;
+}
+
+/* list the touchscreens found, without opening them */
+int nw_usb_list(void)
+{
+	const struct nwusb_transport *t = &nw_usb_native;
+	struct nwusb_dev devs[NWUSB_MAXDEVS];
+	int i, nr;
+
+	nr = nw_usb_scan(t, devs);
+	if (nr < 0) {
+		fprintf(stderr, "Error scanning for touchscreens (%d)\n", nr);
+		return 1;
 	}
 
-	return nw;
+	if (!nr)
+		fprintf(stderr, "Error: No touchscreen detected\n");
+
+	for (i=0; i<nr; i++)
+		printf("Bus %03d Device %03d: ID %04x:%04x%s%s\n",
+		       devs[i].bus_nr, devs[i].dev_nr, NWUSB_VID, devs[i].pid,
+		       devs[i].serial[0] ? " serial " : "", devs[i].serial);
+
+	if (t->release)
+		t->release(devs, nr);
+
+	return !nr;
 }
 
 void nw_usb_deinit(struct nwusb *nw)
 {
-	nw_usb_close(nw->hid);
+	nw->t->close(nw);
 	free(nw);
 }
 
+/* serve show_info from the settings cache if possible */
+int nw_usb_set_cached(struct nwusb *nw)
+{
+	nw->cache.use = 1;
+
+	return 0;
+}
+
 int nw_usb_show_info(struct nwusb *nw)
 {
-	unsigned int val;
+	unsigned int val[NWUSB_GOT_MAX + 1], got = 0;
+
+	if (nw->cache.use)
+		got = nw_usb_cache_load(nw, val);
+
+	if (got != NWUSB_GOT_ALL) {
+		got |= nw_usb_query(nw, NWUSB_GOT_ALL & ~got, val);
+		if (got == NWUSB_GOT_ALL && !nw->t->nocache) {
+			nw->cache.serial = val[NWUSB_GOT_SERIAL];
+			nw->cache.firmware = val[NWUSB_GOT_FIRMWARE];
+			nw->cache.valid = 1;
+			nw_usb_cache_store(nw, val);
+		}
+	}
 
-	if (nw_usb_get_firmware(nw, &val))
-		printf("Version:\t\t%d.%02d\n", val>>8, val & 0xff);
+	if (got & (1 << NWUSB_GOT_FIRMWARE))
+		fprintf(nw->out, "Version:\t\t%d.%02d\n",
+			val[NWUSB_GOT_FIRMWARE] >> 8,
+			val[NWUSB_GOT_FIRMWARE] & 0xff);
 	else
-		fprintf(stderr, "Error reading firmware version\n");
+		nw_usb_error(nw, "Error reading firmware version\n");
 
-	if (nw_usb_get_serial(nw, &val))
-		printf("Serial:\t\t\t%u\n", val);
+	if (got & (1 << NWUSB_GOT_SERIAL))
+		fprintf(nw->out, "Serial:\t\t\t%u\n", val[NWUSB_GOT_SERIAL]);
 	else
-		fprintf(stderr, "Error reading serial number\n");
+		nw_usb_error(nw, "Error reading serial number\n");
 
-	if (nw_usb_get_model(nw, &val))
-		printf("Model:\t\t\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_MODEL))
+		fprintf(nw->out, "Model:\t\t\t%d\n", val[NWUSB_GOT_MODEL]);
 	else
-		fprintf(stderr, "Error reading model\n");
+		nw_usb_error(nw, "Error reading model\n");
 
-	if (nw_usb_get_hw_caps(nw, &val))
-		printf("HW capabilities:\t0x%02x\n", val);
+	if (got & (1 << NWUSB_GOT_HWCAPS))
+		fprintf(nw->out, "HW capabilities:\t0x%02x\n",
+			val[NWUSB_GOT_HWCAPS]);
 	else
-		fprintf(stderr, "Error reading HW capabilities\n");
+		nw_usb_error(nw, "Error reading HW capabilities\n");
 
-	if (nw_usb_get_rightclick_delay(nw, &val))
-		printf("Rightclick delay:\t%d ms\n", val*10);
+	if (got & (1 << NWUSB_GOT_RIGHTCLICKDELAY))
+		fprintf(nw->out, "Rightclick delay:\t%d ms\n",
+			val[NWUSB_GOT_RIGHTCLICKDELAY]*10);
 	else
-		fprintf(stderr, "Error reading rightclick delay\n");
+		nw_usb_error(nw, "Error reading rightclick delay\n");
 
-	if (nw_usb_get_doubleclick_time(nw, &val))
-		printf("Doubleclick time:\t%d ms\n", val*10);
+	if (got & (1 << NWUSB_GOT_DOUBLECLICKTIME))
+		fprintf(nw->out, "Doubleclick time:\t%d ms\n",
+			val[NWUSB_GOT_DOUBLECLICKTIME]*10);
 	else
-		fprintf(stderr, "Error reading doubleclick delay\n");
+		nw_usb_error(nw, "Error reading doubleclick delay\n");
 
-	if (nw_usb_get_report_mode(nw, &val))
-		printf("Report mode:\t\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_REPORTMODE))
+		fprintf(nw->out, "Report mode:\t\t%d\n",
+			val[NWUSB_GOT_REPORTMODE]);
 	else
-		fprintf(stderr, "Error reading report mode\n");
+		nw_usb_error(nw, "Error reading report mode\n");
 
-	if (nw_usb_get_drag_threshold(nw, &val))
-		printf("Drag threshold:\t\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_DRAGTHRESHOLD))
+		fprintf(nw->out, "Drag threshold:\t\t%d\n",
+			val[NWUSB_GOT_DRAGTHRESHOLD]);
 	else
-		fprintf(stderr, "Error reading drag threshold\n");
+		nw_usb_error(nw, "Error reading drag threshold\n");
 
-	if (nw_usb_get_buzzer_time(nw, &val))
-		printf("Buzzer time:\t\t%d ms\n", val*10);
+	if (got & (1 << NWUSB_GOT_BUZZERTIME))
+		fprintf(nw->out, "Buzzer time:\t\t%d ms\n",
+			val[NWUSB_GOT_BUZZERTIME]*10);
 	else
-		fprintf(stderr, "Error reading buzzer time\n");
+		nw_usb_error(nw, "Error reading buzzer time\n");
 
-	if (nw_usb_get_buzzer_tone(nw, &val))
-		printf("Buzzer tone:\t\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_BUZZERTONE))
+		fprintf(nw->out, "Buzzer tone:\t\t%d\n",
+			val[NWUSB_GOT_BUZZERTONE]);
 	else
-		fprintf(stderr, "Error reading buzzer tone\n");
+		nw_usb_error(nw, "Error reading buzzer tone\n");
 
-	if (nw_usb_get_calibration_key(nw, &val))
-		printf("Calibration key:\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_CALIBRATIONKEY))
+		fprintf(nw->out, "Calibration key:\t%d\n",
+			val[NWUSB_GOT_CALIBRATIONKEY]);
 	else
-		fprintf(stderr, "Error reading calibration key\n");
+		nw_usb_error(nw, "Error reading calibration key\n");
 
-	if (nw_usb_get_calibration_presses(nw, &val))
-		printf("Calibration presses:\t%d\n", val);
+	if (got & (1 << NWUSB_GOT_CALIBRATIONPRESSES))
+		fprintf(nw->out, "Calibration presses:\t%d\n",
+			val[NWUSB_GOT_CALIBRATIONPRESSES]);
 	else
-		fprintf(stderr, "Error reading calibration presses\n");
+		nw_usb_error(nw, "Error reading calibration presses\n");
 
-	return 0;
+	return got != NWUSB_GOT_ALL;
 }
 
 int nw_usb_calibrate(struct nwusb *nw, int enable)
@@ -483,7 +1785,8 @@ int nw_usb_set_rightclick_delay(struct nwusb *nw, int ms)
 {
 	unsigned char buf[] = { 'C', 2, 0x30, ms/10};
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_RIGHTCLICKDELAY,
+			  (ms/10) & 0xff);
 }
 
 /* unit is 1/100 sec, 0 = no double clicks */
@@ -491,14 +1794,16 @@ int nw_usb_set_doubleclick_time(struct nwusb *nw, int ms)
 {
 	unsigned char buf[] = { 'C', 2, 0x31, ms/10 };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_DOUBLECLICKTIME,
+			  (ms/10) & 0xff);
 }
 
 int nw_usb_set_drag_threshold(struct nwusb *nw, int value)
 {
 	unsigned char buf[] = { 'C', 3, 0x33, value>>8, value&0xff };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_DRAGTHRESHOLD,
+			  value & 0xffff);
 }
 
 /* bitmask of modes to be used */
@@ -506,7 +1811,8 @@ int nw_usb_set_report_mode(struct nwusb *nw, int mode)
 {
 	unsigned char buf[] = { 'C', 2, 0x32, mode };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_REPORTMODE,
+			  mode & 0xff);
 }
 
 /* unit is 1/100 sec, 0 = disabled */
@@ -514,7 +1820,8 @@ int nw_usb_set_buzzer_time(struct nwusb *nw, int ms)
 {
 	unsigned char buf[] = { 'C', 2, 0x34, ms/10 };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_BUZZERTIME,
+			  (ms/10) & 0xff);
 }
 
 /* lower values means higher tones */
@@ -522,7 +1829,8 @@ int nw_usb_set_buzzer_tone(struct nwusb *nw, int value)
 {
 	unsigned char buf[] = { 'C', 2, 0x35, value };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_BUZZERTONE,
+			  value & 0xff);
 }
 
 /* 0 = disabled */
@@ -530,12 +1838,172 @@ int nw_usb_set_calibration_key(struct nwusb *nw, int key)
 {
 	unsigned char buf[] = { 'C', 2, 0x40, key };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_CALIBRATIONKEY,
+			  key & 0xff);
 }
 
 int nw_usb_set_calibration_presses(struct nwusb *nw, int value)
 {
 	unsigned char buf[] = { 'C', 2, 0x41, value };
 
-	return nw_usb_send(nw, buf, sizeof(buf));
+	return nw_usb_set(nw, buf, sizeof(buf), NWUSB_GOT_CALIBRATIONPRESSES,
+			  value & 0xff);
+}
+
+/* read "<setting> = <value>" lines of a profile into want[], indexed by
+   nw_usb_queries[] entry. Returns bitmask of entries set, or -1 on error */
+static int nw_usb_read_profile(struct nwusb *nw, const char *file,
+			       unsigned int *want)
+{
+	char line[256], name[64];
+	int i, val, end, nr = 0, set = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		nw_usb_error(nw, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		nr++;
+
+		if (line[strspn(line, " \t\r\n")] == '#'
+		    || line[strspn(line, " \t\r\n")] == 0)
+			continue;
+
+		/* only whitespace or a comment may follow the value */
+		end = 0;
+		if (sscanf(line, " %63[a-z-] = %i%n", name, &val, &end) == 2)
+			end += strspn(line + end, " \t\r\n");
+
+		if (!end || (line[end] && line[end] != '#')) {
+			nw_usb_error(nw, "%s:%d: syntax error\n", file, nr);
+			goto err;
+		}
+
+		for (i=0; i<NWUSB_NR_QUERIES; i++)
+			if (nw_usb_queries[i].name
+			    && !strcmp(name, nw_usb_queries[i].name))
+				break;
+
+		if (i == NWUSB_NR_QUERIES) {
+			nw_usb_error(nw, "%s:%d: unknown setting '%s'\n",
+				file, nr, name);
+			goto err;
+		}
+
+		if (val < 0 || val % nw_usb_queries[i].unit) {
+			nw_usb_error(nw, "%s:%d: value must be 0 or a positive "
+				"multiple of %d\n", file, nr,
+				nw_usb_queries[i].unit);
+			goto err;
+		}
+
+		val /= nw_usb_queries[i].unit;
+		if (val >= 1 << (8 * nw_usb_queries[i].len)) {
+			nw_usb_error(nw, "%s:%d: value out of range\n",
+				file, nr);
+			goto err;
+		}
+
+		want[i] = val;
+		set |= 1 << i;
+	}
+
+	fclose(f);
+
+	return set;
+
+err:
+	fclose(f);
+
+	return -1;
+}
+
+/* bring the device in line with a profile, only writing the settings
+   that differ and reading them back afterwards */
+int nw_usb_apply(struct nwusb *nw, const char *file)
+{
+	unsigned int want[NWUSB_NR_QUERIES], val[NWUSB_GOT_MAX + 1];
+	unsigned int wanted = 0, written = 0, got;
+	int i, set, got_nr, ret = 0;
+
+	set = nw_usb_read_profile(nw, file, want);
+	if (set == -1)
+		return 1;
+
+	for (i=0; i<NWUSB_NR_QUERIES; i++)
+		if (set & (1 << i))
+			wanted |= 1 << nw_usb_queries[i].got;
+
+	/* identify the device as well, for the cache updates */
+	got = nw_usb_query(nw, wanted | NWUSB_GOT_KEY, val);
+	if ((got & wanted) != wanted) {
+		nw_usb_error(nw, "Error reading current settings\n");
+		return 1;
+	}
+
+	if ((got & NWUSB_GOT_KEY) == NWUSB_GOT_KEY) {
+		nw->cache.serial = val[NWUSB_GOT_SERIAL];
+		nw->cache.firmware = val[NWUSB_GOT_FIRMWARE];
+		nw->cache.valid = 1;
+	}
+
+	for (i=0; i<NWUSB_NR_QUERIES; i++) {
+		unsigned char buf[] = { 'C', 1 + nw_usb_queries[i].len,
+					nw_usb_queries[i].code, 0, 0 };
+
+		got_nr = nw_usb_queries[i].got;
+		if (!(set & (1 << i)) || val[got_nr] == want[i])
+			continue;
+
+		if (nw_usb_queries[i].len == 2) {
+			buf[3] = want[i] >> 8;
+			buf[4] = want[i] & 0xff;
+		} else {
+			buf[3] = want[i];
+		}
+
+		fprintf(nw->out, "%s: %u -> %u\n", nw_usb_queries[i].name,
+			val[got_nr] * nw_usb_queries[i].unit,
+			want[i] * nw_usb_queries[i].unit);
+
+		if (nw_usb_set(nw, buf, 3 + nw_usb_queries[i].len, got_nr,
+			       want[i])) {
+			nw_usb_error(nw, "Error writing %s\n",
+				nw_usb_queries[i].name);
+			ret = 1;
+			continue;
+		}
+
+		written |= 1 << got_nr;
+	}
+
+	if (!written)
+		return ret;
+
+	/* verify */
+	got = nw_usb_query(nw, written, val);
+	for (i=0; i<NWUSB_NR_QUERIES; i++) {
+		got_nr = nw_usb_queries[i].got;
+		if (!(written & (1 << got_nr)))
+			continue;
+
+		if (!(got & (1 << got_nr))) {
+			nw_usb_error(nw, "Error reading back %s\n",
+				nw_usb_queries[i].name);
+			ret = 1;
+		} else if (val[got_nr] != want[i]) {
+			nw_usb_error(nw, "Error: %s is %u instead of %u\n",
+				nw_usb_queries[i].name,
+				val[got_nr] * nw_usb_queries[i].unit,
+				want[i] * nw_usb_queries[i].unit);
+			/* keep the cache in line with the device */
+			nw_usb_cache_update(nw, got_nr, val[got_nr], 0);
+			ret = 1;
+		}
+	}
+
+	return ret;
 }
@@ -15,10 +15,21 @@ struct nwusb;
 
 struct nwusb *nw_usb_init(int bus_nr, int dev_nr);
 
+struct nwusb *nw_usb_init_mock(int latency, int reorder, int drop);
+
 void nw_usb_deinit(struct nwusb *nw);
 
+int nw_usb_init_all(struct nwusb **nw, int max);
+
+int nw_usb_run_all(struct nwusb **nw, int nr,
+		   int (*fn)(struct nwusb *nw, void *data), void *data);
+
+int nw_usb_list(void);
+
 int nw_usb_show_info(struct nwusb *nw);
 
+int nw_usb_set_cached(struct nwusb *nw);
+
 int nw_usb_set_rightclick_delay(struct nwusb *nw, int ms);
 
 int nw_usb_set_doubleclick_time(struct nwusb *nw, int ms);
@@ -35,6 +46,8 @@ int nw_usb_set_calibration_key(struct nwusb *nw, int key);
 
 int nw_usb_set_calibration_presses(struct nwusb *nw, int value);
 
+int nw_usb_apply(struct nwusb *nw, const char *file);
+
 int nw_usb_calibrate(struct nwusb *nw, int enable);
 
 #endif /* _NWTOOL_USB_H_ */
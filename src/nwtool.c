@@ -17,15 +17,53 @@
 #define NW_NEED_SERIAL	1
 #define NW_NEED_USB	1
 
+#define NW_MAX_SERIAL	32
+#define NW_MAX_USB	16
+#define NW_MAX_USB_OPS	64
+
 static void usage(void)
 {
 	fprintf(stderr, "usage: nwtool [OPTION] ...\n"
 		"  -h, --help\t\t\t\tshow usage info\n"
 		"  -v, --version\t\t\t\tshow version info\n"
-		"  -s, --serial <device>\t\t\taccess touchscreen over serial\n"
+		"  -s, --serial <device>\t\t\taccess touchscreen over serial "
+		"(may be repeated)\n"
+		"  -B, --buffer-size <bytes>\t\tset serial receive buffer size\n"
+		"  -w, --record <file>\t\t\trecord raw serial data to <file>\n"
+		"  -P, --replay <file>\t\t\treplay recorded serial data to "
+		"kernel\n"
+		"  -F, --replay-fast <file>\t\treplay as fast as possible\n"
+		"  -M, --max-motion-rate <hz>\t\tcoalesce motion to max <hz> "
+		"reports/s\n"
+		"  -T, --transform <a,b,c,d,e,f>\t\tcalibration matrix\n"
+		"  -X, --transform-file <file>\t\tread calibration matrix from "
+		"<file>,\n"
+		"\t\t\t\t\treloaded on SIGHUP\n"
+		"  -j, --jitter-filter <min[:beta[:dz]]>\tsmooth with min "
+		"cutoff (Hz),\n"
+		"\t\t\t\t\tspeed coefficient and dead zone\n"
+		"  -I, --info-timeout <ms[:retries]>\twait up to <ms> for info, "
+		"resending\n"
+		"\t\t\t\t\tthe query <retries> times\n"
+		"  -a, --reconnect\t\t\treopen device if disconnected "
+		"while\n"
+		"\t\t\t\t\tforwarding\n"
+		"  -Q, --queue <size>\t\t\twrite to kernel from a separate "
+		"thread,\n"
+		"\t\t\t\t\tqueueing up to <size> reports\n"
+		"  -R, --rt-priority <prio>\t\tSCHED_FIFO priority for -L\n"
+		"  -A, --cpu <nr>\t\t\tbind to CPU <nr> for -L\n"
+		"  -L, --low-latency\t\t\tlow latency serial forwarding\n"
 #ifdef WITH_USB
 		"  -u[<bus[:dev]>], --usb[=<bus[:dev]>]\taccess TS over USB [on bus/dev nr]\n"
+		"  -U[<ms[:re[:drop]]>], --usb-mock[=...]\temulate USB TS with "
+		"latency,\n"
+		"\t\t\t\t\treorder and drop chance (%%)\n"
+		"  -E, --enumerate\t\t\tlist USB touchscreens\n"
+		"  -n, --all\t\t\t\taccess all USB TS found, running the\n"
+		"\t\t\t\t\tUSB options on them concurrently\n"
 		"  -i, --info\t\t\t\tdisplay info and current settings\n"
+		"  -K, --cached\t\t\t\tdisplay USB settings from cache\n"
 		"  -r, --rightclick <ms>\t\t\tset rightclick delay to <ms>\n"
 		"  -d, --doubleclick <ms>\t\tset doubleclick time to <ms>\n"
 		"  -D, --drag-threshold <value>\t\tset drag threshold to <value>\n"
@@ -34,6 +72,7 @@ static void usage(void)
 		"  -t, --buzzer-tone <value>\t\tset buzzer tone to <value>\n"
 		"  -k, --calibration-key <value>\t\tset calibration key to <value>\n"
 		"  -p, --calibration-presses <nr>\tset nr of calibration presses\n"
+		"  -l, --apply <file>\t\t\tapply settings from profile <file>\n"
 #endif
 		"  -f, --forward\t\t\t\tforward touchscreen events to kernel\n"
 		"  -c, --calibrate\t\t\tput touchscreen in calibration mode\n"
@@ -43,7 +82,6 @@ static void usage(void)
 	exit(1);
 }
 
-#ifdef WITH_USB
 static int parse_nr(char *arg)
 {
 	long val;
@@ -58,6 +96,103 @@ static int parse_nr(char *arg)
 	return val;
 }
 
+/* parse jitter filter mincutoff[:beta[:deadzone]] string */
+static void parse_filter(char *arg, double *mincutoff, double *beta,
+			 int *deadzone)
+{
+	char *endp;
+
+	*beta = 0;
+	*deadzone = 0;
+
+	*mincutoff = strtod(arg, &endp);
+	if (*endp == ':') {
+		*beta = strtod(endp + 1, &endp);
+		if (*endp == ':')
+			*deadzone = strtol(endp + 1, &endp, 0);
+	}
+
+	if (*endp) {
+		fprintf(stderr, "invalid filter parameters '%s'\n", arg);
+		usage();
+	}
+}
+
+/* parse info timeout ms[:retries] string */
+static void parse_timeout(char *arg, int *ms, int *retries)
+{
+	char *endp;
+
+	*retries = 0;
+
+	*ms = strtol(arg, &endp, 0);
+	if (*endp == ':')
+		*retries = strtol(endp + 1, &endp, 0);
+
+	if (*endp) {
+		fprintf(stderr, "invalid timeout '%s'\n", arg);
+		usage();
+	}
+}
+
+/* options for every -s device, applied when -i or -f runs so it does
+   not matter where they are given */
+static struct {
+	int info, info_ms, info_retries;
+	int motion, motion_rate;
+	int filter, deadzone;
+	double mincutoff, beta;
+	int queue, queue_size;
+	int reconnect;
+} ser_all;
+
+static void ser_setup(struct nwserial **ser, int nr_ser, int forward)
+{
+	int i;
+
+	for (i=0; i<nr_ser; i++) {
+		if (ser_all.info
+		    && nw_serial_set_info_timeout(ser[i], ser_all.info_ms,
+						  ser_all.info_retries))
+			usage();
+
+		if (!forward)
+			continue;
+
+		if (ser_all.motion
+		    && nw_serial_set_motion_rate(ser[i], ser_all.motion_rate))
+			usage();
+
+		if (ser_all.filter
+		    && nw_serial_set_filter(ser[i], ser_all.mincutoff,
+					    ser_all.beta, ser_all.deadzone))
+			usage();
+
+		if (ser_all.queue
+		    && nw_serial_set_queue(ser[i], ser_all.queue_size))
+			usage();
+
+		if (ser_all.reconnect)
+			nw_serial_set_reconnect(ser[i]);
+	}
+}
+
+/* USB option, with its argument parsed */
+struct usb_op {
+	int c;
+	int value;
+	const char *arg;
+};
+
+/* touchscreens opened with --all and the USB options to run on them */
+static struct {
+	struct nwusb *dev[NW_MAX_USB];
+	int nr;
+	struct usb_op op[NW_MAX_USB_OPS];
+	int nr_op;
+} usb_all;
+
+#ifdef WITH_USB
 /* parse usb bus or bus:dev string */
 static void parse_bus_dev(char *arg, int *bus, int *dev)
 {
@@ -82,6 +217,82 @@ static void parse_bus_dev(char *arg, int *bus, int *dev)
 	}
 }
 
+
+/* parse mock latency[:reorder[:drop]] string */
+static void parse_mock(char *arg, int *latency, int *reorder, int *drop)
+{
+	char *endp;
+
+	*latency = strtol(arg, &endp, 0);
+	if (*endp == ':') {
+		*reorder = strtol(endp + 1, &endp, 0);
+		if (*endp == ':')
+			*drop = strtol(endp + 1, &endp, 0);
+	}
+
+	if (*endp) {
+		fprintf(stderr, "invalid mock parameters '%s'\n", arg);
+		usage();
+	}
+}
+
+static int usb_run_op(struct nwusb *usb, const struct usb_op *op)
+{
+	switch (op->c) {
+	case 'i': return nw_usb_show_info(usb);
+	case 'K': return nw_usb_set_cached(usb);
+	case 'r': return nw_usb_set_rightclick_delay(usb, op->value);
+	case 'd': return nw_usb_set_doubleclick_time(usb, op->value);
+	case 'D': return nw_usb_set_drag_threshold(usb, op->value);
+	case 'm': return nw_usb_set_report_mode(usb, op->value);
+	case 'b': return nw_usb_set_buzzer_time(usb, op->value);
+	case 't': return nw_usb_set_buzzer_tone(usb, op->value);
+	case 'k': return nw_usb_set_calibration_key(usb, op->value);
+	case 'p': return nw_usb_set_calibration_presses(usb, op->value);
+	case 'l': return nw_usb_apply(usb, op->arg);
+	case 'c':
+	case 'C': return nw_usb_calibrate(usb, op->c == 'c');
+	}
+
+	return 0;
+}
+
+/* --all worker, runs all USB options on one touchscreen */
+static int usb_run_ops(struct nwusb *usb, void *data)
+{
+	int i, ret = 0;
+
+	for (i=0; i<usb_all.nr_op; i++) {
+		if (!usb_run_op(usb, &usb_all.op[i]))
+			continue;
+
+		ret = 1;
+		/* like without --all, a failed profile is fatal */
+		if (usb_all.op[i].c == 'l')
+			break;
+	}
+
+	return ret;
+}
+
+/* run USB option on the -u touchscreen, or queue it for --all */
+static void usb_do(struct nwusb *usb, int c, int value, const char *arg)
+{
+	struct usb_op op = { c, value, arg };
+
+	if (usb_all.nr) {
+		if (usb_all.nr_op == NW_MAX_USB_OPS) {
+			fprintf(stderr, "Max %d USB options allowed with "
+				"--all\n", NW_MAX_USB_OPS);
+			usage();
+		}
+		usb_all.op[usb_all.nr_op++] = op;
+	} else if (usb) {
+		if (usb_run_op(usb, &op) && c == 'l')
+			exit(1);
+	}
+}
+
 #endif /* WITH_USB */
 
 static void missing(int need)
@@ -104,8 +315,26 @@ int main(int argc, char **argv)
 		{ "help",		no_argument,	 	0, 'h' },
 		{ "version",		no_argument,	 	0, 'v' },
 		{ "serial",		required_argument,	0, 's' },
+		{ "buffer-size",	required_argument,	0, 'B' },
+		{ "record",		required_argument,	0, 'w' },
+		{ "replay",		required_argument,	0, 'P' },
+		{ "replay-fast",	required_argument,	0, 'F' },
+		{ "max-motion-rate",	required_argument,	0, 'M' },
+		{ "transform",		required_argument,	0, 'T' },
+		{ "transform-file",	required_argument,	0, 'X' },
+		{ "jitter-filter",	required_argument,	0, 'j' },
+		{ "info-timeout",	required_argument,	0, 'I' },
+		{ "reconnect",		no_argument,		0, 'a' },
+		{ "queue",		required_argument,	0, 'Q' },
+		{ "rt-priority",	required_argument,	0, 'R' },
+		{ "cpu",		required_argument,	0, 'A' },
+		{ "low-latency",	no_argument,		0, 'L' },
 		{ "usb",		optional_argument,	0, 'u' },
+		{ "usb-mock",		optional_argument,	0, 'U' },
+		{ "enumerate",		no_argument,		0, 'E' },
+		{ "all",		no_argument,		0, 'n' },
 		{ "info",		no_argument,	 	0, 'i' },
+		{ "cached",		no_argument,		0, 'K' },
 		{ "rightclick",		required_argument, 	0, 'r' },
 		{ "doubleclick",	required_argument,	0, 'd' },
 		{ "drag-threshold",	required_argument,	0, 'D' },
@@ -114,6 +343,7 @@ int main(int argc, char **argv)
 		{ "buzzer-tone",	required_argument,	0, 't' },
 		{ "calibration-key",	required_argument,	0, 'k' },
 		{ "calibration-presses", required_argument,	0, 'p' },
+		{ "apply",		required_argument,	0, 'l' },
 		{ "forward", 		no_argument,		0, 'f' },
 		{ "calibrate",		no_argument,		0, 'c' },
 		{ "cancel-calibration",	no_argument,		0, 'C' },
@@ -121,10 +351,15 @@ int main(int argc, char **argv)
 	};
 	int c, usb_bus_nr = -1, usb_dev_nr = -1;
 	struct nwusb *usb = 0;
-	struct nwserial *ser = 0;
+#ifdef WITH_USB
+	int latency, reorder, drop, failed;
+#endif /* WITH_USB */
+	struct nwserial *ser[NW_MAX_SERIAL];
+	int i, nr_ser = 0, rt_prio = 0, rt_cpu = -1, replayed = 0, listed = 0;
+	int low_latency = 0;
 
 	do {
-		c = getopt_long(argc, argv, "hvu::s:ir:d:D:m:b:t:k:p:fcC",
+		c = getopt_long(argc, argv, "hvu::U::Ens:B:w:P:F:M:T:X:j:I:aQ:R:A:LiKr:d:D:m:b:t:k:p:l:fcC",
 				options, 0);
 
 		switch (c) {
@@ -135,22 +370,114 @@ int main(int argc, char **argv)
 			break;
 
 		case 's':
-			if (usb) {
-				fprintf(stderr, "Only one of -u | -s options "
-					"allowed\n");
+			if (usb || usb_all.nr) {
+				fprintf(stderr, "Only one of -u | -n | -s "
+					"options allowed\n");
+				usage();
+			}
+
+			if (nr_ser == NW_MAX_SERIAL) {
+				fprintf(stderr, "Max %d serial devices "
+					"allowed\n", NW_MAX_SERIAL);
 				usage();
 			}
 
-			ser = nw_serial_init(optarg);
-			if (!ser)
+			ser[nr_ser] = nw_serial_init(optarg);
+			if (!ser[nr_ser])
+				usage();
+			nr_ser++;
+			break;
+
+		/* applies to the last -s device */
+		case 'B':
+			if (!nr_ser)
+				missing(NW_NEED_SERIAL);
+			if (nw_serial_set_bufsize(ser[nr_ser-1],
+						  parse_nr(optarg)))
+				usage();
+			break;
+
+		/* applies to the last -s device */
+		case 'w':
+			if (!nr_ser)
+				missing(NW_NEED_SERIAL);
+			if (nw_serial_set_record(ser[nr_ser-1], optarg))
+				usage();
+			break;
+
+		case 'P':
+		case 'F':
+			if (nw_serial_replay(optarg, c == 'F',
+					     ser_all.motion_rate))
+				exit(1);
+			replayed = 1;
+			break;
+
+		/* applied when forwarding or a replay starts */
+		case 'M':
+			ser_all.motion = 1;
+			ser_all.motion_rate = parse_nr(optarg);
+			break;
+
+		/* applies to the last -s device */
+		case 'T':
+			if (!nr_ser)
+				missing(NW_NEED_SERIAL);
+			if (nw_serial_set_transform(ser[nr_ser-1], optarg))
 				usage();
 			break;
 
+		/* applies to the last -s device */
+		case 'X':
+			if (!nr_ser)
+				missing(NW_NEED_SERIAL);
+			if (nw_serial_set_transform_file(ser[nr_ser-1], optarg))
+				usage();
+			break;
+
+		/* applied when forwarding starts */
+		case 'j':
+			ser_all.filter = 1;
+			parse_filter(optarg, &ser_all.mincutoff, &ser_all.beta,
+				     &ser_all.deadzone);
+			break;
+
+		/* applied when -i or -f runs */
+		case 'I':
+			ser_all.info = 1;
+			parse_timeout(optarg, &ser_all.info_ms,
+				      &ser_all.info_retries);
+			break;
+
+		/* applied when forwarding starts */
+		case 'a':
+			ser_all.reconnect = 1;
+			break;
+
+		/* applied when forwarding starts */
+		case 'Q':
+			ser_all.queue = 1;
+			ser_all.queue_size = parse_nr(optarg);
+			break;
+
+		case 'R':
+			rt_prio = parse_nr(optarg);
+			break;
+
+		case 'A':
+			rt_cpu = parse_nr(optarg);
+			break;
+
+		/* applied when forwarding starts */
+		case 'L':
+			low_latency = 1;
+			break;
+
 #ifdef WITH_USB
 		case 'u':
-			if (ser) {
-				fprintf(stderr, "Only one of -u | -s options "
-					"allowed\n");
+			if (nr_ser || usb || usb_all.nr) {
+				fprintf(stderr, "Only one of -u | -n | -s "
+					"options allowed\n");
 				usage();
 			}
 
@@ -161,95 +488,103 @@ int main(int argc, char **argv)
 			if (!usb)
 				usage();
 			break;
+
+		case 'U':
+			if (nr_ser || usb || usb_all.nr) {
+				fprintf(stderr, "Only one of -u | -n | -s "
+					"options allowed\n");
+				usage();
+			}
+
+			latency = reorder = drop = 0;
+			if (optarg)
+				parse_mock(optarg, &latency, &reorder, &drop);
+
+			usb = nw_usb_init_mock(latency, reorder, drop);
+			if (!usb)
+				usage();
+			break;
+
+		case 'E':
+			if (nw_usb_list())
+				exit(1);
+			listed = 1;
+			break;
+
+		case 'n':
+			if (nr_ser || usb || usb_all.nr) {
+				fprintf(stderr, "Only one of -u | -n | -s "
+					"options allowed\n");
+				usage();
+			}
+
+			usb_all.nr = nw_usb_init_all(usb_all.dev, NW_MAX_USB);
+			if (!usb_all.nr)
+				usage();
+			break;
 #endif /* WITH_USB */
 
 		case 'i':
-			if (ser)
-				nw_serial_show_info(ser);
+			ser_setup(ser, nr_ser, 0);
+			if (nr_ser)
+				for (i=0; i<nr_ser; i++)
+					nw_serial_show_info(ser[i]);
 #ifdef WITH_USB
-			else if (usb)
-				nw_usb_show_info(usb);
+			else if (usb || usb_all.nr)
+				usb_do(usb, c, 0, 0);
 #endif /* WITH_USB */
 			else
 				missing(NW_NEED_USB|NW_NEED_SERIAL);
 			break;
 #ifdef WITH_USB
-		case 'r':
-			if (usb)
-				nw_usb_set_rightclick_delay(usb,
-							    parse_nr(optarg));
-			else
+		case 'K':
+		case 'l':
+			if (!usb && !usb_all.nr)
 				missing(NW_NEED_USB);
+			usb_do(usb, c, 0, optarg);
 			break;
 
+		case 'r':
 		case 'd':
-			if (usb)
-				nw_usb_set_doubleclick_time(usb,
-							    parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 'D':
-			if (usb)
-				nw_usb_set_drag_threshold(usb,
-							  parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 'm':
-			if (usb)
-				nw_usb_set_report_mode(usb, parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 'b':
-			if (usb)
-				nw_usb_set_buzzer_time(usb, parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 't':
-			if (usb)
-				nw_usb_set_buzzer_tone(usb, parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 'k':
-			if (usb)
-				nw_usb_set_calibration_key(usb,
-							   parse_nr(optarg));
-			else
-				missing(NW_NEED_USB);
-			break;
-
 		case 'p':
-			if (usb)
-				nw_usb_set_calibration_presses(
-					usb, parse_nr(optarg));
-			else
+			if (!usb && !usb_all.nr)
 				missing(NW_NEED_USB);
+			usb_do(usb, c, parse_nr(optarg), optarg);
 			break;
 
 #endif /* WITH_USB */
 		case 'f':
-			if (ser)
-				nw_serial_forward(ser);
-			else
+			if (!nr_ser)
 				missing(NW_NEED_SERIAL);
+
+			ser_setup(ser, nr_ser, 1);
+
+			if (low_latency) {
+				for (i=0; i<nr_ser; i++)
+					if (nw_serial_set_low_latency(ser[i]))
+						fprintf(stderr, "Warning: "
+							"forwarding without "
+							"low latency tty\n");
+				if (nw_serial_set_realtime(rt_prio, rt_cpu))
+					exit(1);
+			}
+
+			nw_serial_forward(ser, nr_ser);
 			break;
 
 		case 'c':
 		case 'C':
-			if (ser)
-				nw_serial_calibrate(ser, c == 'c');
+			if (nr_ser)
+				for (i=0; i<nr_ser; i++)
+					nw_serial_calibrate(ser[i], c == 'c');
 #ifdef WITH_USB
-			else if (usb)
-				nw_usb_calibrate(usb, c == 'c');
+			else if (usb || usb_all.nr)
+				usb_do(usb, c, 0, 0);
 #endif /* WITH_USB */
 			else
 				missing(NW_NEED_USB|NW_NEED_SERIAL);
@@ -265,13 +600,21 @@ int main(int argc, char **argv)
 
 	} while (c != -1);
 
-	if (ser)
-		nw_serial_deinit(ser);
+	if (nr_ser)
+		for (i=0; i<nr_ser; i++)
+			nw_serial_deinit(ser[i]);
 #ifdef WITH_USB
 	else if (usb)
 		nw_usb_deinit(usb);
+	else if (usb_all.nr) {
+		failed = nw_usb_run_all(usb_all.dev, usb_all.nr, usb_run_ops, 0);
+		for (i=0; i<usb_all.nr; i++)
+			nw_usb_deinit(usb_all.dev[i]);
+		if (failed)
+			return 1;
+	}
 #endif /* WITH_USB */
-	else
+	else if (!replayed && !listed)
 		usage();
 
 	return 0;